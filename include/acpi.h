@@ -0,0 +1,109 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limine.h>
+
+// Root System Description Pointer (revision 2 layout)
+struct acpi_rsdp {
+    char signature[8];          // "RSD PTR "
+    uint8_t checksum;           // Covers the first 20 bytes
+    char oem_id[6];
+    uint8_t revision;           // 0 = ACPI 1.0 (RSDT only), 2+ = XSDT present
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+// Header shared by every system description table
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;            // Whole table, header included
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// System Resource Affinity Table: header, 12 reserved bytes, then entries
+struct acpi_srat {
+    struct acpi_sdt_header header;
+    uint32_t table_revision;
+    uint64_t reserved;
+} __attribute__((packed));
+
+#define SRAT_TYPE_CPU_AFFINITY     0
+#define SRAT_TYPE_MEMORY_AFFINITY  1
+#define SRAT_TYPE_X2APIC_AFFINITY  2
+
+#define SRAT_FLAG_ENABLED          (1U << 0)
+
+struct acpi_srat_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct acpi_srat_cpu_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint8_t proximity_domain_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_domain_hi[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_memory_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint32_t proximity_domain;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t length_bytes;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed));
+
+struct acpi_srat_x2apic_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed));
+
+// System Locality Information Table: a localities x localities matrix of
+// relative distances, 10 meaning local
+struct acpi_slit {
+    struct acpi_sdt_header header;
+    uint64_t localities;
+    uint8_t distances[];
+} __attribute__((packed));
+
+// Locate the RSDT/XSDT through the RSDP handed over by Limine
+void acpi_init(struct limine_rsdp_response *rsdp, struct limine_hhdm_response *hhdm);
+
+// Copy the tables listed in the RSDT/XSDT out of firmware memory, which
+// pmm_reclaim_boot_memory calls before it frees ACPI-reclaimable memory.
+// Pointers inside the copies (the FADT's DSDT, for one) still point at
+// firmware memory and may be stale afterwards.
+void acpi_save_tables(void);
+
+// Find a table by its 4-character signature. Returns NULL if it is missing
+// or fails its checksum. Before pmm_reclaim_boot_memory this is the
+// firmware's table; after it, the saved copy, which stays valid for good.
+// Pointers returned before the reclaim must not be kept past it.
+struct acpi_sdt_header *acpi_find_table(const char *signature);
+
+#endif // ACPI_H
@@ -0,0 +1,114 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Upper bound on CPUs for statically sized per-CPU data
+#define MAX_CPUS 16
+
+#define RFLAGS_IF (1UL << 9)
+
+// Index of the executing CPU. Only the BSP runs until SMP bring-up exists.
+static inline unsigned int cpu_id(void) {
+    return 0;
+}
+
+// Disable interrupts and return the previous RFLAGS
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+// Re-enable interrupts if they were enabled when irq_save was called
+static inline void irq_restore(uint64_t flags) {
+    if (flags & RFLAGS_IF) {
+        asm volatile("sti" ::: "memory");
+    }
+}
+
+// Read the time stamp counter (used for cycle counts in benchmarks)
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Execute CPUID for leaf/subleaf
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile("cpuid"
+                 : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf), "c"(subleaf));
+}
+
+#define CPUID_1_ECX_PCID   (1U << 17)
+#define CPUID_1_ECX_POPCNT (1U << 23)
+#define CPUID_80000001_EDX_PDPE1GB (1U << 26)
+
+// True if the CPU can map 1GB pages
+static inline bool cpu_has_1g_pages(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000001) {
+        return false;
+    }
+    cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+    return edx & CPUID_80000001_EDX_PDPE1GB;
+}
+
+// True if the CPU supports process-context identifiers (CR4.PCIDE)
+static inline bool cpu_has_pcid(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    return ecx & CPUID_1_ECX_PCID;
+}
+
+// Control registers
+#define CR4_PGE           (1UL << 7)
+#define CR4_PCIDE         (1UL << 17)
+#define CR3_PCID_MASK     0xFFFUL
+#define CR3_NOFLUSH       (1UL << 63)   // With CR4.PCIDE: keep the PCID's TLB entries
+
+static inline uint64_t read_cr3(void) {
+    uint64_t value;
+    asm volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(uint64_t value) {
+    asm volatile("mov %0, %%cr3" :: "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t value;
+    asm volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint64_t value) {
+    asm volatile("mov %0, %%cr4" :: "r"(value) : "memory");
+}
+
+// TSC frequency in MHz from CPUID leaf 0x15 (crystal ratio) or 0x16 (base
+// frequency), 0 if the CPU reports neither
+static inline uint64_t tsc_mhz(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+    
+    if (max_leaf >= 0x15) {
+        cpuid(0x15, 0, &eax, &ebx, &ecx, &edx);
+        if (eax && ebx && ecx) {
+            return (uint64_t)ecx * ebx / eax / 1000000;
+        }
+    }
+    if (max_leaf >= 0x16) {
+        cpuid(0x16, 0, &eax, &ebx, &ecx, &edx);
+        return eax & 0xFFFF;
+    }
+    return 0;
+}
+
+#endif // CPU_H
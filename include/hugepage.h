@@ -0,0 +1,47 @@
+#ifndef HUGEPAGE_H
+#define HUGEPAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limine.h>
+
+// Pools of physical frames for 2MB and 1GB mappings. Frames are taken from
+// the PMM while it still has aligned blocks (at boot, or whenever
+// hugepage_reserve is called) and stay in the pool until hugepage_shrink
+// gives them back, so huge mappings don't depend on fragmentation.
+typedef enum {
+    HUGEPAGE_2M,
+    HUGEPAGE_1G,
+    HUGEPAGE_SIZES
+} hugepage_size_t;
+
+// Reserve the boot pools (HUGEPAGE_BOOT_2M / HUGEPAGE_BOOT_1G frames)
+void hugepage_init(struct limine_hhdm_response *hhdm);
+
+// Grow a pool by up to count frames. Returns how many were added.
+size_t hugepage_reserve(hugepage_size_t size, size_t count);
+
+// Give up to count unused frames of a pool back to the PMM. Returns how
+// many were released.
+size_t hugepage_shrink(hugepage_size_t size, size_t count);
+
+// Take a frame from a pool. Returns its physical address, NULL if empty.
+void *hugepage_alloc(hugepage_size_t size);
+
+// Return a frame from hugepage_alloc to its pool
+void hugepage_free(void *frame, hugepage_size_t size);
+
+// Map a pool frame at virt with one page table entry. Without CPU support
+// for 1GB pages, 1GB frames are mapped as 512 2MB pages.
+bool hugepage_map(uint64_t *pml4, uint64_t virt, void *frame, hugepage_size_t size,
+                  uint64_t flags);
+
+// Remove a mapping made by hugepage_map
+void hugepage_unmap(uint64_t *pml4, uint64_t virt, hugepage_size_t size);
+
+void hugepage_print_stats(void);
+
+void test_hugepage(void);
+
+#endif // HUGEPAGE_H
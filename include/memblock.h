@@ -0,0 +1,42 @@
+#ifndef MEMBLOCK_H
+#define MEMBLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limine.h>
+
+#define MEMBLOCK_MAX_REGIONS 128
+
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+} memblock_region_t;
+
+// Early boot range allocator over the Limine memmap. It only tracks which
+// usable memory is reserved, so it works before the PMM has any metadata.
+// The first MB starts out reserved.
+void memblock_init(struct limine_memmap_response *memmap);
+
+// Mark [base, base + size) as in use. Returns false if the table is full.
+bool memblock_reserve(uint64_t base, uint64_t size);
+
+// Find size bytes aligned to align inside one usable region and within
+// [min_addr, max_addr), clear of every reservation, without reserving it.
+// Searches from the top if top_down. Returns 0 if nothing fits.
+uint64_t memblock_find_range(uint64_t size, uint64_t align, uint64_t min_addr,
+                             uint64_t max_addr, bool top_down);
+
+// Allocate and reserve size bytes, preferring memory above ZONE_DMA.
+// Returns the physical address, 0 on failure. For small early allocations.
+uint64_t memblock_alloc(uint64_t size, uint64_t align);
+
+// Same, but from the top of memory down, so large boot data lands above 4GB
+// when there is memory there and leaves ZONE_DMA32 to devices.
+uint64_t memblock_alloc_high(uint64_t size, uint64_t align);
+
+// Close memblock and return its reservations (sorted, merged) for the PMM
+// to keep off its free lists. Later memblock calls fail.
+size_t memblock_handover(const memblock_region_t **reserved);
+
+#endif // MEMBLOCK_H
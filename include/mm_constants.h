@@ -16,6 +16,9 @@
 #define LARGE_PAGE_ALIGN_UP(addr)   (((addr) + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1))
 #define IS_LARGE_PAGE_ALIGNED(addr) (((addr) & (LARGE_PAGE_SIZE - 1)) == 0)
 
+#define HUGE_PAGE_1G_SIZE   (1UL * 1024 * 1024 * 1024)
+#define HUGE_PAGE_1G_SHIFT  30
+
 // Pages <-> bytes conversion
 #define BYTES_TO_PAGES(bytes) (((bytes) + PAGE_SIZE - 1) / PAGE_SIZE)
 #define PAGES_TO_BYTES(pages) ((pages) * PAGE_SIZE)
@@ -26,6 +29,45 @@
 #define PMM_MAX_CONTIGUOUS_PAGES (1UL << PMM_MAX_ORDER)  // 2048 pages
 #define PMM_MAX_CONTIGUOUS_BYTES (PMM_MAX_CONTIGUOUS_PAGES * PAGE_SIZE)  // 8MB
 
+// Sparse memory model: page metadata exists per section, and only for
+// sections that contain usable memory
+#define PMM_SECTION_SHIFT       15  // 128MB sections (32768 pages)
+#define PMM_SECTION_PAGES       (1UL << PMM_SECTION_SHIFT)
+#define PMM_SECTION_WORDS       (PMM_SECTION_PAGES / 64)  // bitmap words per section
+#define PMM_EARLY_INIT_BYTES    (1UL * 1024 * 1024 * 1024)  // per node, the rest is deferred
+
+// Zone limits (multiples of the largest buddy block)
+#define ZONE_DMA_LIMIT          (16UL * 1024 * 1024)         // 16MB
+#define ZONE_DMA32_LIMIT        (4UL * 1024 * 1024 * 1024)   // 4GB
+#define ZONE_WATERMARK_RATIO    64  // low watermark = managed pages / ratio
+#define ZONE_WATERMARK_MIN_PAGES 128
+
+// Contiguous memory area (CMA) for allocations above PMM_MAX_CONTIGUOUS_BYTES
+#define CMA_MAX_BYTES           (256UL * 1024 * 1024)        // 256MB
+#define CMA_RAM_FRACTION        8   // and no more than 1/8 of usable RAM
+#define CMA_MIN_ALIGN           PMM_MAX_CONTIGUOUS_BYTES     // no buddy block straddles it
+#define CMA_MAX_ALIGN           (1UL * 1024 * 1024 * 1024)   // 1GB, largest contig alignment
+
+// Per-CPU page frame cache watermarks (in order-0 pages)
+#define PCP_HIGH                64  // drain a batch once the hot list reaches this
+#define PCP_LOW                 0   // refill a batch once the cache drops to this
+#define PCP_BATCH               16  // pages moved per refill/drain under pmm_lock
+
+// Pre-zeroed page pool
+#define ZERO_POOL_SIZE          256 // zeroed frames kept ready for *_zeroed allocs
+#define ZERO_POOL_BATCH         16  // frames zeroed per idle work step
+#define ZERO_POOL_MIN_FREE      4096 // stop filling below this many free pages
+
+// Compaction
+#define PMM_MAX_SHRINKERS       4
+#define COMPACT_MIN_ORDER       3   // failed allocs of this order and up trigger compaction
+#define COMPACT_IDLE_ORDER      9   // idle work keeps 2MB blocks available
+#define COMPACT_IDLE_THRESHOLD  500 // fragmentation index that starts idle compaction
+
+// Huge page pools, filled at boot before the buddy lists fragment
+#define HUGEPAGE_BOOT_2M        8   // 16MB of 2MB frames
+#define HUGEPAGE_BOOT_1G        0   // 1GB frames are reserved on demand
+
 // Protected regions
 #define FIRST_MB_BYTES          (1024 * 1024)
 #define FIRST_MB_PAGES          (FIRST_MB_BYTES / PAGE_SIZE)  // 256
@@ -59,6 +101,19 @@
 #define PT_SHIFT         12
 #define PT_INDEX_MASK    0x1FF
 
+// Range operations covering more pages than this reload CR3 instead of
+// issuing invlpg per page
+#define VMM_FLUSH_THRESHOLD  32
+// Page tables taken from the PMM per bulk allocation when mapping a range
+#define VMM_TABLE_BATCH      16
+// PCIDs handed to address spaces (0 stays with the boot page tables)
+#define VMM_PCID_COUNT       4096
+// Demand paging: lazy region slots, default pages mapped per fault, and
+// log2 buckets of the fault latency histogram
+#define VMM_MAX_LAZY_REGIONS       32
+#define VMM_FAULT_AROUND_PAGES     16
+#define VMM_FAULT_LATENCY_BUCKETS  12
+
 // Heap allocator
 #define SLAB_MIN_SIZE    16
 #define SLAB_MAX_SIZE    2048
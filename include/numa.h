@@ -0,0 +1,38 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cpu.h>
+
+#define NUMA_MAX_NODES        8
+#define NUMA_MAX_RANGES       32
+#define NUMA_LOCAL_DISTANCE   10  // SLIT distance of a node to itself
+#define NUMA_REMOTE_DISTANCE  20  // assumed between nodes when there is no SLIT
+
+// Node of each CPU, indexed by cpu_id()
+extern uint8_t numa_cpu_node[MAX_CPUS];
+
+// Read memory and CPU affinity from the ACPI SRAT and node distances from
+// the SLIT. Call after acpi_init and before pmm_init. Without an SRAT the
+// machine is treated as a single node 0.
+void numa_init(void);
+
+size_t numa_node_count(void);
+
+// Node owning a physical address. Addresses outside every SRAT range belong
+// to the node of the nearest range below them (node 0 if there is none).
+int numa_node_of_phys(uint64_t phys);
+
+// Relative distance between two nodes, NUMA_LOCAL_DISTANCE for the same one
+uint8_t numa_distance(int from, int to);
+
+// All numa_node_count() nodes ordered by distance from node, node first
+const uint8_t *numa_node_order(int node);
+
+// Node of the executing CPU
+static inline int numa_local_node(void) {
+    return numa_cpu_node[cpu_id()];
+}
+
+#endif // NUMA_H
@@ -3,9 +3,55 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <limine.h> 
 
+// Physical memory zones, lowest first. Ordinary allocations come from the
+// highest zone that has memory and only fall back to lower ones while those
+// stay above their low watermark. ZONE_CMA is not an address range: it holds
+// the contiguous memory area, which ordinary allocations only borrow once the
+// other zones are exhausted.
+#define ZONE_DMA        0   // below ZONE_DMA_LIMIT, for ISA-style DMA
+#define ZONE_DMA32      1   // below ZONE_DMA32_LIMIT, for 32-bit DMA devices
+#define ZONE_NORMAL     2   // everything above
+#define ZONE_CMA        3   // contiguous memory area, placed at boot
+#define PMM_ZONE_COUNT  4
 
+// Page descriptor, one per physical frame (32 bytes). This is the allocator's
+// record of every frame: free-list linkage, block order, zone and NUMA node,
+// reference count and the owner of allocated pages.
+struct page {
+    union {
+        struct {
+            struct page *next;  // Free list links, valid while PAGE_FLAG_FREE is set
+            struct page *prev;
+        };
+        struct {
+            uint64_t *pml4;     // Where a PAGE_FLAG_MOVABLE page is mapped
+            uint64_t virt;
+        };
+        struct {
+            uint64_t asid_generation;   // PCID of an address space's PML4 page,
+            uint64_t asid;              // valid in that generation (vmm.c)
+        };
+    };
+    void *private;          // Owner data, e.g. the slab header for slab pages
+    uint16_t refcount;
+    uint16_t flags;
+    uint8_t order;          // Order of the free block this page heads
+    uint8_t zone;
+    uint8_t node;           // NUMA node, fixed at boot
+    uint8_t reserved;
+};
+
+#define PAGE_FLAG_FREE       0x0001  // Heads a block on a buddy free list
+#define PAGE_FLAG_HEAP_SLAB  0x0002  // kmalloc slab page, private -> slab_header_t
+#define PAGE_FLAG_CACHE_SLAB 0x0004  // Object cache slab page, private -> SLAB
+#define PAGE_FLAG_MOVABLE    0x0008  // Only reached through pml4/virt, may be migrated
+#define PAGE_FLAG_PCP        0x0010  // Parked in a per-CPU cache
+
+// Allocates the PMM metadata from memblock and takes over its reservations,
+// so call it after memblock_init and any early memblock allocations
 void pmm_init(struct limine_memmap_response *memmap, struct limine_hhdm_response *hhdm);
 
 // Allocate a single page (4KB)
@@ -17,32 +63,131 @@ void pmm_free_page(void *page);
 // Allocate multiple contiguous pages
 void *pmm_alloc_pages(size_t count);
 
+// Allocate contiguous pages (up to PMM_MAX_CONTIGUOUS_PAGES) from the given
+// NUMA node, falling back to the nearest other nodes. The plain allocators
+// prefer the node of the executing CPU.
+void *pmm_alloc_pages_node(size_t count, int node);
+
 // Free multiple contiguous pages
 void pmm_free_pages(void *pages, size_t count);
 
-// Allocate aligned memory
+// Allocate up to count single pages into out[] under one lock acquisition,
+// carved from the largest available blocks. Returns how many were allocated;
+// each page may be freed individually.
+size_t pmm_alloc_pages_bulk(size_t count, void **out);
+
+// Free count single pages under one lock acquisition
+void pmm_free_pages_bulk(size_t count, void **pages);
+
+// Allocate contiguous pages from the given zone or a lower one
+void *pmm_alloc_pages_zone(size_t count, int zone);
+
+// Allocate exactly count contiguous pages, returning the rounding tail of
+// the buddy block to the free lists
+void *pmm_alloc_pages_exact(size_t count);
+
+// Free pages obtained from pmm_alloc_pages_exact
+void pmm_free_pages_exact(void *pages, size_t count);
+
+// Allocate count physically contiguous pages of any size, aligned to align
+// bytes (a power of two up to CMA_MAX_ALIGN). Tries the contiguous memory
+// area first, then the rest of RAM, then migrates movable pages out of the
+// contiguous area.
+void *pmm_alloc_contig(size_t count, size_t align);
+
+// Free pages obtained from pmm_alloc_contig
+void pmm_free_contig(void *pages, size_t count);
+
+// Allocate exactly count contiguous pages (no power-of-two rounding) aligned
+// to align bytes, from the lowest (first fit) or the smallest (best fit) free
+// run in the default zone that fits, then anywhere. Free with
+// pmm_free_pages_exact.
+void *pmm_alloc_range(size_t count, size_t align, bool best_fit);
+
+// Allocate aligned memory. Alignments above the block size are honored
+// through the range allocator.
 void *pmm_alloc_aligned(size_t size, size_t alignment);
 
 // Free aligned memory
 void pmm_free_aligned(void *ptr, size_t size);
 
+// Free bootloader- and ACPI-reclaimable memory into the buddy allocator,
+// after saving the ACPI tables (acpi_save_tables). Call once, after the
+// last use of any Limine response.
+void pmm_reclaim_boot_memory(void);
+
+// Bring the deferred sections holding count pages at phys online now, for
+// boot memory that needs descriptors before idle time gets to it. Returns
+// false if part of the range has no PMM metadata.
+bool pmm_online_range(void *phys, size_t count);
+
+// Descriptor lookups. Physical addresses are passed as void * like the rest
+// of the PMM API; the *_to_page functions return NULL outside managed RAM.
+struct page *pmm_phys_to_page(void *phys);
+struct page *pmm_virt_to_page(const void *virt);
+void *pmm_page_to_phys(struct page *page);
+
+// Convert between physical addresses and their higher-half direct map
+void *pmm_phys_to_virt(void *phys);
+void *pmm_virt_to_phys(const void *virt);
+
+// Take or drop a reference on a page; the last unref frees it
+void pmm_ref_page(void *page);
+void pmm_unref_page(void *page);
+
+// Allocate a page that will only be accessed through the single mapping
+// pml4/virt (mapped by the caller), so compaction may migrate it. Free with
+// pmm_free_page after unmapping.
+void *pmm_alloc_page_movable(uint64_t *pml4, uint64_t virt);
+
+// Migrate movable pages to build one free block of the given order.
+// Returns true if a block was freed up.
+bool pmm_compact(size_t order);
+
+// Register a callback that frees cached, unused pages (empty slabs and the
+// like) when memory gets tight. Returns the number of pages released.
+typedef size_t (*pmm_shrinker_t)(void);
+void pmm_register_shrinker(pmm_shrinker_t shrink);
+
+// Fragmentation index (0-1000) for a request of the given order, or -1 if
+// a free block that large exists. Near 0 an allocation would fail for lack
+// of memory, near 1000 because free memory is scattered.
+int pmm_fragmentation_index(size_t order);
+
 // Get total system memory in bytes
 size_t pmm_get_total_memory(void);
 
 // Get used memory in bytes
 size_t pmm_get_used_memory(void);
 
-// Get free memory in bytes
+// Get free memory in bytes, including deferred sections not yet online
 size_t pmm_get_free_memory(void);
-// Allocate a single zeroed page
+// Allocate a single zeroed page (served from the pre-zeroed pool when possible)
 void *pmm_alloc_page_zeroed(void);
 // Allocate multiple zeroed pages
 void *pmm_alloc_pages_zeroed(size_t count);
 
+// Return this CPU's cached single pages to the buddy allocator
+void pmm_drain_local_cache(void);
+
+// Run deferred PMM work (bringing deferred memory sections online, zeroed
+// page pool refill, compaction) from the idle loop. Returns true while more
+// work is pending.
+bool pmm_idle_work(void);
+
 // Print memory statistics
 void pmm_print_stats(void);
 
+// Verify the free/used counters against a full bitmap scan
+bool pmm_check_counters(void);
+
 // Test PMM functionality
 void test_pmm(void);
 
+// Test page migration through compaction (needs the VMM up)
+void test_compaction(void);
+
+// Benchmark PMM hot paths (reports cycle counts over serial)
+void bench_pmm(void);
+
 #endif // PMM_H
\ No newline at end of file
@@ -52,6 +52,9 @@ void slab_init(void);
 CACHE* cache_create(size_t size, int align, int flags);
 void* cache_alloc(CACHE* cache);
 void cache_free(CACHE* cache, void* obj);
+void cache_destroy(CACHE* cache);
+void slab_print_stats(void);
 void spin_lock(SPIN_LOCK* lock);
 void spin_unlock(SPIN_LOCK* lock);
+int spin_trylock(SPIN_LOCK* lock);
 #endif
\ No newline at end of file
@@ -3,26 +3,81 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include <limine.h>
+#include <mm_constants.h>
 
-// Page Table Entry Flags
-#define PTE_PRESENT   (1ull << 0)
-#define PTE_WRITABLE  (1ull << 1)
-#define PTE_USER      (1ull << 2)
-#define PTE_NX        (1ull << 63) // No Execute
+// Page table entry flags are in mm_constants.h
+#define PTE_NX        PTE_NO_EXECUTE
 
+// Page fault error code bits
+#define PF_ERR_PRESENT   (1u << 0)  // Protection fault (clear: page not present)
+#define PF_ERR_WRITE     (1u << 1)
+#define PF_ERR_USER      (1u << 2)
+#define PF_ERR_RESERVED  (1u << 3)
+#define PF_ERR_FETCH     (1u << 4)
+
+// Reserve the page tables vmm_init will build (kernel PML4, kernel image,
+// framebuffer and HHDM) from memblock. Call after memblock_init and before
+// pmm_init; without it vmm_init takes them from the PMM.
+void vmm_reserve_boot_tables(struct limine_memmap_response* memmap);
 void vmm_init(void);
 void vmm_map_page(uint64_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags);
+// Map a 2MB / 1GB page; virt and phys must be aligned to its size
+void vmm_map_huge_page(uint64_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags);
+// (the 1GB version fails if smaller pages are still mapped in the range)
+bool vmm_map_huge_page_1g(uint64_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags);
 void vmm_switch_pml4(uint64_t* pml4);
 
 extern uint64_t* kernel_pml4;
 
+// Unmap the page at virt, a whole 2MB/1GB page if virt is in one
 void vmm_unmap_page(uint64_t* pml4, uint64_t virt);
+// Move a 4KB mapping from old_phys to new_phys (page migration)
+bool vmm_remap_page(uint64_t* pml4, uint64_t virt, uint64_t old_phys, uint64_t new_phys);
 uint64_t vmm_get_physical_address(uint64_t* pml4, uint64_t virt);
 uint64_t* vmm_create_address_space(void);
 void vmm_destroy_address_space(uint64_t* pml4);
+// Map / unmap a range of 4KB pages with one walk per page table and a
+// single TLB flush decision at the end
 void vmm_map_range(uint64_t* pml4, uint64_t virt_start, uint64_t phys_start, size_t length, uint64_t flags);
+void vmm_unmap_range(uint64_t* pml4, uint64_t virt_start, size_t size);
+// Demand paging. Pages of a lazy region are allocated, zeroed and mapped on
+// first touch, along with the rest of their fault_around-page window (a
+// power of two up to 512; 1 maps only the faulting page). A region belongs
+// to the address space it was registered in and may not overlap a 2MB or
+// 1GB page.
+bool vmm_register_lazy(uint64_t* pml4, uint64_t virt, size_t size, uint64_t flags,
+                       size_t fault_around);
+// Unmap the lazy region starting at virt and free the frames it touched
+void vmm_unregister_lazy(uint64_t* pml4, uint64_t virt);
+// Resolve a page fault at virt in the current address space. Returns false
+// if it isn't a not-present fault in a lazy region that allows the access,
+// or if virt has been huge-mapped since.
+bool vmm_handle_fault(uint64_t virt, uint64_t error_code);
+
+typedef struct {
+    uint64_t faults;            // Resolved faults
+    uint64_t unresolved;        // Faults left to the caller (not lazy, or not allowed)
+    uint64_t pages_mapped;      // Including fault-around neighbours
+    uint64_t cycles_total;      // Latency of resolved faults
+    uint64_t cycles_max;
+    // latency_buckets[i]: faults taking under 512 << i cycles (and at least
+    // 256 << i); the last bucket takes everything slower
+    uint64_t latency_buckets[VMM_FAULT_LATENCY_BUCKETS];
+} vmm_fault_stats_t;
+
+void vmm_get_fault_stats(vmm_fault_stats_t* stats);
+void vmm_print_fault_stats(void);
+
 // testing function to verify VMM functionality
 void test_vmm(void);
+// Benchmark page-by-page against range mapping of 1GB
+void bench_vmm(void);
+// Benchmark address-space switches with and without PCIDs and global pages
+void bench_context_switch(void);
+// Test lazy regions on a sparse 1GB buffer, with and without fault-around
+void test_demand_paging(void);
 
 
 #endif
\ No newline at end of file
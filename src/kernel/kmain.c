@@ -12,6 +12,11 @@
 #include <vmm.h>
 #include <slab.h>
 #include <heap.h>
+#include <acpi.h>
+#include <numa.h>
+#include <memblock.h>
+#include <hugepage.h>
+#include <cpu.h>
 
 
 //------- Limine Requests (send them to a different .c file later)-------
@@ -33,6 +38,12 @@ volatile struct limine_executable_address_request kernel_address_request = {
     .revision = 0
 };
 
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_rsdp_request rsdp_request = {
+    .id = LIMINE_RSDP_REQUEST_ID,
+    .revision = 0
+};
+
 // Set the base revision to 4, this is recommended as this is the latest
 // base revision described by the Limine boot protocol specification.
 // See specification for further info.
@@ -78,6 +89,10 @@ static void hcf(void) {
 // If renaming kmain() to something else, make sure to change the
 // linker script accordingly.
 void kmain(void) {
+    // Start of the boot-to-ready metric; the TSC value itself is what
+    // firmware and bootloader took
+    uint64_t boot_start = rdtsc();
+
     // Ensure the bootloader actually understands our base revision (see spec).
     if (LIMINE_BASE_REVISION_SUPPORTED(limine_base_revision) == false) {
         hcf();
@@ -109,8 +124,16 @@ void kmain(void) {
     init_idt(); // Initialize the IDT
     print_memmap();
     
+    // Early allocations come from memblock until pmm_init takes it over
+    memblock_init(memmap_request.response);
+    acpi_init(rsdp_request.response, hhdm_request.response);
+    numa_init();
+    vmm_reserve_boot_tables(memmap_request.response);
     pmm_init(memmap_request.response, hhdm_request.response);
+    // Take the boot huge page pools before anything fragments memory
+    hugepage_init(hhdm_request.response);
     test_pmm(); 
+    bench_pmm();
     vmm_init();
     // Simple HHDM test(might delete later or add to vmm tests)
     uint64_t *test_ptr = (uint64_t*)(hhdm_request.response->offset + 0x200000);
@@ -122,10 +145,34 @@ void kmain(void) {
         kprintf("HHDM Write Test Failed!\n");
     }
     test_vmm(); 
+    bench_vmm();
+    bench_context_switch();
+    test_demand_paging();
+    test_compaction();
+    test_hugepage();
     slab_init();
     heap_init(hhdm_request.response);
     test_heap();
 
-    // We're done, just hang...
-    hcf();
+    // Everything that reads Limine responses has run by now
+    pmm_reclaim_boot_memory();
+
+    uint64_t boot_cycles = rdtsc() - boot_start;
+    uint64_t mhz = tsc_mhz();
+    kprintf("Boot: kmain entered at TSC %lu, ready after %lu cycles", boot_start, boot_cycles);
+    if (mhz) {
+        kprintf(" (%lu us)", boot_cycles / mhz);
+    }
+    kprintf("\n");
+    pmm_print_stats();
+    hugepage_print_stats();
+    vmm_print_fault_stats();
+
+    // Nothing else to run yet: use idle time for deferred memory work and
+    // sleep until the next interrupt once it's done
+    for (;;) {
+        if (!pmm_idle_work()) {
+            asm ("hlt");
+        }
+    }
 }
@@ -0,0 +1,152 @@
+// ACPI table discovery. Only reads tables; nothing here changes hardware state.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limine.h>
+#include <kprintf.h>
+#include <string.h>
+#include <mm_constants.h>
+#include <pmm.h>
+#include <acpi.h>
+
+static uintptr_t hhdm_offset = 0;
+static struct acpi_sdt_header *root_table = NULL;    // RSDT or XSDT
+static bool root_is_xsdt = false;
+
+// Copies of the tables listed in the root table, made by acpi_save_tables
+// before their memory is reclaimed
+static struct acpi_sdt_header **saved_tables = NULL;
+static size_t saved_count = 0;
+
+static void *acpi_phys_to_virt(uint64_t phys) {
+    return (void *)(phys + hhdm_offset);
+}
+
+static bool acpi_checksum_ok(const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    uint8_t sum = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+void acpi_init(struct limine_rsdp_response *rsdp_response, struct limine_hhdm_response *hhdm) {
+    if (!rsdp_response || !hhdm) {
+        kprintf("ACPI: No RSDP from the bootloader, tables unavailable\n");
+        return;
+    }
+
+    hhdm_offset = hhdm->offset;
+
+    // Base revision 3 and later pass the physical address, older ones a
+    // pointer into the HHDM
+    uintptr_t address = (uintptr_t)rsdp_response->address;
+    struct acpi_rsdp *rsdp = address >= hhdm_offset ? (struct acpi_rsdp *)address
+                                                    : acpi_phys_to_virt(address);
+
+    if (memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || !acpi_checksum_ok(rsdp, 20)) {
+        kprintf("ACPI Error: Invalid RSDP at 0x%lx\n", address);
+        return;
+    }
+
+    uint64_t root_phys = rsdp->rsdt_address;
+    if (rsdp->revision >= 2 && rsdp->xsdt_address) {
+        root_phys = rsdp->xsdt_address;
+        root_is_xsdt = true;
+    }
+
+    struct acpi_sdt_header *root = acpi_phys_to_virt(root_phys);
+    if (!acpi_checksum_ok(root, root->length)) {
+        kprintf("ACPI Error: %s at 0x%lx fails its checksum\n",
+                root_is_xsdt ? "XSDT" : "RSDT", root_phys);
+        return;
+    }
+
+    root_table = root;
+    kprintf("ACPI: %s at 0x%lx (revision %d)\n",
+            root_is_xsdt ? "XSDT" : "RSDT", root_phys, rsdp->revision);
+}
+
+static size_t root_entry_count(void) {
+    size_t entry_size = root_is_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+    return (root_table->length - sizeof(struct acpi_sdt_header)) / entry_size;
+}
+
+static struct acpi_sdt_header *root_entry(size_t i) {
+    size_t entry_size = root_is_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+    const uint8_t *entries = (const uint8_t *)(root_table + 1);
+
+    // XSDT entries are only 4-byte aligned
+    uint64_t phys = 0;
+    memcpy(&phys, entries + i * entry_size, entry_size);
+    return acpi_phys_to_virt(phys);
+}
+
+void acpi_save_tables(void) {
+    if (!root_table) {
+        return;
+    }
+
+    // One block: the pointer array, then each valid table 8-byte aligned
+    size_t count = root_entry_count();
+    size_t total = count * sizeof(struct acpi_sdt_header *);
+    for (size_t i = 0; i < count; i++) {
+        struct acpi_sdt_header *table = root_entry(i);
+        if (acpi_checksum_ok(table, table->length)) {
+            total += (table->length + 7) & ~7UL;
+        }
+    }
+
+    void *block = count ? pmm_alloc_pages(BYTES_TO_PAGES(total)) : NULL;
+    if (!block) {
+        kprintf("ACPI Error: No memory to save %lu tables, dropping them\n", count);
+        root_table = NULL;
+        return;
+    }
+
+    saved_tables = acpi_phys_to_virt((uintptr_t)block);
+    uint8_t *pos = (uint8_t *)(saved_tables + count);
+    for (size_t i = 0; i < count; i++) {
+        struct acpi_sdt_header *table = root_entry(i);
+        if (!acpi_checksum_ok(table, table->length)) {
+            continue;
+        }
+
+        memcpy(pos, table, table->length);
+        saved_tables[saved_count++] = (struct acpi_sdt_header *)pos;
+        pos += (table->length + 7) & ~7UL;
+    }
+
+    root_table = NULL;
+    kprintf("ACPI: Saved %lu tables (%lu bytes) ahead of reclaim\n", saved_count, total);
+}
+
+struct acpi_sdt_header *acpi_find_table(const char *signature) {
+    for (size_t i = 0; i < saved_count; i++) {
+        if (memcmp(saved_tables[i]->signature, signature, 4) == 0) {
+            return saved_tables[i];
+        }
+    }
+
+    if (!root_table) {
+        return NULL;
+    }
+
+    size_t count = root_entry_count();
+    for (size_t i = 0; i < count; i++) {
+        struct acpi_sdt_header *table = root_entry(i);
+        if (memcmp(table->signature, signature, 4) == 0) {
+            if (!acpi_checksum_ok(table, table->length)) {
+                kprintf("ACPI Warning: %c%c%c%c table fails its checksum\n",
+                        signature[0], signature[1], signature[2], signature[3]);
+                return NULL;
+            }
+            return table;
+        }
+    }
+
+    return NULL;
+}
@@ -2,6 +2,7 @@
 #include <kprintf.h>
 #include <stdint.h>
 #include <string.h> 
+#include <vmm.h>
 #include "pic.h"
 
 __attribute__((aligned(0x10))) 
@@ -57,6 +58,11 @@ void init_idt(void) {
 }
 
 void page_fault_handler(uint64_t error_code, uint64_t fault_addr) {
+    // Lazy regions are mapped on first touch; retry the access
+    if (vmm_handle_fault(fault_addr, error_code)) {
+        return;
+    }
+    
     kprintf("\n=== PAGE FAULT ===\n");
     kprintf("Address: 0x%lx\n", fault_addr);
     kprintf("Error Code: 0x%lx\n", error_code);
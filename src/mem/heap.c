@@ -94,25 +94,53 @@ static slab_header_t *create_slab(int class) {
     }
     *prev = NULL;
     
+    // Tag the page so kfree can find the slab from any object pointer
+    struct page *desc = pmm_phys_to_page(page);
+    desc->flags |= PAGE_FLAG_HEAP_SLAB;
+    desc->private = slab;
+    
     return slab;
 }
 
-// Find slab that owns this object
-static slab_header_t *find_slab_for_object(void *ptr, int class) {
-    if (!ptr || class < 0 || class >= NUM_SLAB_CLASSES) {
+// Release a slab page, clearing its descriptor tag first
+static void destroy_slab(slab_header_t *slab) {
+    struct page *desc = pmm_virt_to_page(slab);
+    desc->flags &= ~PAGE_FLAG_HEAP_SLAB;
+    desc->private = NULL;
+    pmm_free_page(pmm_virt_to_phys(slab));
+}
+
+// Find slab that owns this object via its page descriptor
+static slab_header_t *find_slab_for_object(void *ptr) {
+    struct page *desc = ptr ? pmm_virt_to_page(ptr) : NULL;
+    
+    if (!desc || !(desc->flags & PAGE_FLAG_HEAP_SLAB)) {
         return NULL;
     }
+    return (slab_header_t *)desc->private;
+}
+
+// Shrinker for the PMM: release the empty slab kfree keeps at the head of
+// each class list. Skips the work if the heap lock is busy, which includes
+// a kmalloc further up the stack waiting on the PMM.
+static size_t heap_shrink(void) {
+    size_t freed = 0;
+    
+    if (!spin_trylock(&heap_lock)) {
+        return 0;
+    }
     
-    for (slab_header_t *slab = slab_lists[class]; slab != NULL; slab = slab->next) {
-        uintptr_t slab_start = (uintptr_t)slab;
-        uintptr_t slab_end = slab_start + PAGE_SIZE;
-        uintptr_t obj = (uintptr_t)ptr;
-        
-        if (obj >= slab_start && obj < slab_end) {
-            return slab;
+    for (int i = 0; i < NUM_SLAB_CLASSES; i++) {
+        while (slab_lists[i] && slab_lists[i]->objects_used == 0) {
+            slab_header_t *slab = slab_lists[i];
+            slab_lists[i] = slab->next;
+            destroy_slab(slab);
+            freed++;
         }
     }
-    return NULL;
+    
+    spin_unlock(&heap_lock);
+    return freed;
 }
 
 void heap_init(struct limine_hhdm_response *hhdm) {
@@ -128,6 +156,8 @@ void heap_init(struct limine_hhdm_response *hhdm) {
         slab_lists[i] = NULL;
     }
     
+    pmm_register_shrinker(heap_shrink);
+    
     heap_initialized = true;
     kprintf("Heap initialized. Slab classes: ");
     for (int i = 0; i < NUM_SLAB_CLASSES; i++) {
@@ -153,17 +183,17 @@ void *kmalloc(size_t size) {
     
     int class = get_slab_class(size);
     
-    // Large allocation - use PMM directly
+    // Large allocation - use PMM directly. Anything past the largest buddy
+    // block is served by the PMM's contiguous allocator.
     if (class < 0) {
-        if (size > PMM_MAX_CONTIGUOUS_BYTES - sizeof(size_t)) {
-            kprintf("Heap Error: Allocation of %d bytes exceeds maximum (%d bytes)\n",
-                    size, PMM_MAX_CONTIGUOUS_BYTES - sizeof(size_t));
+        if (size > pmm_get_total_memory() - sizeof(size_t)) {
+            kprintf("Heap Error: Allocation of %lu bytes exceeds total memory\n", size);
             spin_unlock(&heap_lock);
             return NULL;
         }
         
         size_t pages = BYTES_TO_PAGES(size + sizeof(size_t));
-        void *mem = pmm_alloc_pages(pages);
+        void *mem = pmm_alloc_pages_exact(pages);
         if (!mem) {
             kprintf("Heap Critical: Out of memory allocating %d bytes (%d pages)\n", 
                     size, pages);
@@ -237,16 +267,8 @@ void kfree(void *ptr) {
     uintptr_t addr = (uintptr_t)ptr;
     
     // Check if it's a small allocation (slab)
-    int class = -1;
-    slab_header_t *slab = NULL;
-    
-    for (int i = 0; i < NUM_SLAB_CLASSES; i++) {
-        slab = find_slab_for_object(ptr, i);
-        if (slab) {
-            class = i;
-            break;
-        }
-    }
+    slab_header_t *slab = find_slab_for_object(ptr);
+    int class = slab ? get_slab_class(slab->object_size) : -1;
     
     if (class >= 0 && slab) {
         // Verify object is within valid range
@@ -273,10 +295,7 @@ void kfree(void *ptr) {
             }
             if (*prev) {
                 *prev = slab->next;
-                
-                // Free the page
-                uintptr_t phys = (uintptr_t)slab - hhdm_offset;
-                pmm_free_page((void *)phys);
+                destroy_slab(slab);
             }
         }
     } else {
@@ -284,14 +303,14 @@ void kfree(void *ptr) {
         size_t *header = (size_t *)ptr - 1;
         size_t pages = *header;
         
-        if (pages == 0 || pages > PMM_MAX_CONTIGUOUS_PAGES) {
+        if (pages == 0 || pages > pmm_get_total_memory() / PAGE_SIZE) {
             kprintf("Heap Error: Invalid large allocation header (pages=%d)\n", pages);
             spin_unlock(&heap_lock);
             return;
         }
         
         uintptr_t phys = (uintptr_t)header - hhdm_offset;
-        pmm_free_pages((void *)phys, pages);
+        pmm_free_pages_exact((void *)phys, pages);
     }
     spin_unlock(&heap_lock);
 }
@@ -307,12 +326,10 @@ void *krealloc(void *ptr, size_t new_size) {
     int old_class = -1;
     size_t old_size = 0;
     
-    for (int i = 0; i < NUM_SLAB_CLASSES; i++) {
-        if (find_slab_for_object(ptr, i)) {
-            old_class = i;
-            old_size = slab_sizes[i];
-            break;
-        }
+    slab_header_t *old_slab = find_slab_for_object(ptr);
+    if (old_slab) {
+        old_class = get_slab_class(old_slab->object_size);
+        old_size = old_slab->object_size;
     }
     
     // NEW: If same size class, just return same pointer
@@ -326,7 +343,7 @@ void *krealloc(void *ptr, size_t new_size) {
         size_t *header = (size_t *)ptr - 1;
         size_t pages = *header;
         
-        if (pages == 0 || pages > PMM_MAX_CONTIGUOUS_PAGES) {
+        if (pages == 0 || pages > pmm_get_total_memory() / PAGE_SIZE) {
             kprintf("Heap Error: krealloc detected corrupted header (pages=%zu)\n", pages);
             return NULL;
         }
@@ -0,0 +1,279 @@
+// Huge page pools. Free frames are linked through their first word, so a
+// pool can hold any number of frames without metadata of its own.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limine.h>
+#include <kprintf.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <slab.h>
+#include <cpu.h>
+#include <mm_constants.h>
+#include <hugepage.h>
+
+typedef struct {
+    const char *name;
+    size_t frame_size;
+    size_t frame_pages;
+    uintptr_t free_list;        // physical address of the first free frame, 0 if none
+    size_t total;               // frames owned by the pool
+    size_t free;
+    uint64_t allocs;
+    uint64_t failures;          // hugepage_alloc found the pool empty
+    SPIN_LOCK lock;
+} hugepage_pool_t;
+
+static hugepage_pool_t pools[HUGEPAGE_SIZES] = {
+    [HUGEPAGE_2M] = { .name = "2MB", .frame_size = LARGE_PAGE_SIZE,
+                      .frame_pages = LARGE_PAGE_SIZE / PAGE_SIZE },
+    [HUGEPAGE_1G] = { .name = "1GB", .frame_size = HUGE_PAGE_1G_SIZE,
+                      .frame_pages = HUGE_PAGE_1G_SIZE / PAGE_SIZE },
+};
+
+static uintptr_t hhdm_offset = 0;
+static bool have_1g_pages = false;
+
+static uintptr_t *frame_link(uintptr_t frame) {
+    return (uintptr_t *)(frame + hhdm_offset);
+}
+
+// Push a frame on its pool's free list. Caller holds the pool lock.
+static void pool_push(hugepage_pool_t *pool, uintptr_t frame) {
+    *frame_link(frame) = pool->free_list;
+    pool->free_list = frame;
+    pool->free++;
+}
+
+// Pop a frame, 0 if the pool is empty. Caller holds the pool lock.
+static uintptr_t pool_pop(hugepage_pool_t *pool) {
+    uintptr_t frame = pool->free_list;
+    if (frame) {
+        pool->free_list = *frame_link(frame);
+        pool->free--;
+    }
+    return frame;
+}
+
+void hugepage_init(struct limine_hhdm_response *hhdm) {
+    if (!hhdm) {
+        kprintf("Hugepage Error: No HHDM response\n");
+        return;
+    }
+
+    hhdm_offset = hhdm->offset;
+    have_1g_pages = cpu_has_1g_pages();
+
+    size_t got_2m = hugepage_reserve(HUGEPAGE_2M, HUGEPAGE_BOOT_2M);
+    size_t got_1g = hugepage_reserve(HUGEPAGE_1G, HUGEPAGE_BOOT_1G);
+    kprintf("Hugepage: Reserved %lu x 2MB, %lu x 1GB (1GB mappings %s)\n",
+            got_2m, got_1g, have_1g_pages ? "supported" : "unsupported");
+}
+
+size_t hugepage_reserve(hugepage_size_t size, size_t count) {
+    if (size >= HUGEPAGE_SIZES) {
+        kprintf("Hugepage Error: Invalid huge page size %d\n", size);
+        return 0;
+    }
+
+    hugepage_pool_t *pool = &pools[size];
+    size_t added = 0;
+
+    // 2MB frames are buddy blocks of order 9, naturally aligned; 1GB frames
+    // go through the contiguous allocator
+    for (; added < count; added++) {
+        void *frame = size == HUGEPAGE_2M
+            ? pmm_alloc_pages(pool->frame_pages)
+            : pmm_alloc_contig(pool->frame_pages, pool->frame_size);
+        if (!frame) {
+            kprintf("Hugepage Warning: %s pool grew by %lu of %lu frames\n",
+                    pool->name, added, count);
+            break;
+        }
+
+        spin_lock(&pool->lock);
+        pool_push(pool, (uintptr_t)frame);
+        pool->total++;
+        spin_unlock(&pool->lock);
+    }
+
+    return added;
+}
+
+size_t hugepage_shrink(hugepage_size_t size, size_t count) {
+    if (size >= HUGEPAGE_SIZES) {
+        kprintf("Hugepage Error: Invalid huge page size %d\n", size);
+        return 0;
+    }
+
+    hugepage_pool_t *pool = &pools[size];
+    size_t released = 0;
+
+    for (; released < count; released++) {
+        spin_lock(&pool->lock);
+        uintptr_t frame = pool_pop(pool);
+        if (frame) {
+            pool->total--;
+        }
+        spin_unlock(&pool->lock);
+
+        if (!frame) break;
+
+        if (size == HUGEPAGE_2M) {
+            pmm_free_pages((void *)frame, pool->frame_pages);
+        } else {
+            pmm_free_contig((void *)frame, pool->frame_pages);
+        }
+    }
+
+    return released;
+}
+
+void *hugepage_alloc(hugepage_size_t size) {
+    if (size >= HUGEPAGE_SIZES) {
+        kprintf("Hugepage Error: Invalid huge page size %d\n", size);
+        return NULL;
+    }
+
+    hugepage_pool_t *pool = &pools[size];
+
+    spin_lock(&pool->lock);
+    uintptr_t frame = pool_pop(pool);
+    if (frame) {
+        pool->allocs++;
+    } else {
+        pool->failures++;
+    }
+    spin_unlock(&pool->lock);
+
+    return (void *)frame;
+}
+
+void hugepage_free(void *frame, hugepage_size_t size) {
+    if (!frame) {
+        kprintf("Hugepage Warning: hugepage_free called with NULL frame\n");
+        return;
+    }
+
+    if (size >= HUGEPAGE_SIZES || (uintptr_t)frame & (pools[size].frame_size - 1)) {
+        kprintf("Hugepage Error: 0x%lx is not a huge page frame of size %d\n",
+                (uintptr_t)frame, size);
+        return;
+    }
+
+    hugepage_pool_t *pool = &pools[size];
+
+    spin_lock(&pool->lock);
+    pool_push(pool, (uintptr_t)frame);
+    spin_unlock(&pool->lock);
+}
+
+bool hugepage_map(uint64_t *pml4, uint64_t virt, void *frame, hugepage_size_t size,
+                  uint64_t flags) {
+    if (size >= HUGEPAGE_SIZES) {
+        kprintf("Hugepage Error: Invalid huge page size %d\n", size);
+        return false;
+    }
+
+    size_t frame_size = pools[size].frame_size;
+    if (virt & (frame_size - 1) || (uintptr_t)frame & (frame_size - 1)) {
+        kprintf("Hugepage Error: 0x%lx -> 0x%lx not aligned to %s\n",
+                virt, (uintptr_t)frame, pools[size].name);
+        return false;
+    }
+
+    if (size == HUGEPAGE_1G && have_1g_pages) {
+        if (!vmm_map_huge_page_1g(pml4, virt, (uintptr_t)frame, flags)) {
+            kprintf("Hugepage Error: Failed to map 1GB page at 0x%lx\n", virt);
+            return false;
+        }
+    } else {
+        for (size_t off = 0; off < frame_size; off += LARGE_PAGE_SIZE) {
+            vmm_map_huge_page(pml4, virt + off, (uintptr_t)frame + off, flags);
+        }
+    }
+    return true;
+}
+
+void hugepage_unmap(uint64_t *pml4, uint64_t virt, hugepage_size_t size) {
+    if (size >= HUGEPAGE_SIZES) {
+        kprintf("Hugepage Error: Invalid huge page size %d\n", size);
+        return;
+    }
+
+    if (size == HUGEPAGE_1G && have_1g_pages) {
+        vmm_unmap_page(pml4, virt);
+        return;
+    }
+
+    for (size_t off = 0; off < pools[size].frame_size; off += LARGE_PAGE_SIZE) {
+        vmm_unmap_page(pml4, virt + off);
+    }
+}
+
+void hugepage_print_stats(void) {
+    kprintf("Huge page pools:\n");
+    for (int s = 0; s < HUGEPAGE_SIZES; s++) {
+        hugepage_pool_t *pool = &pools[s];
+        kprintf("  %s: %lu frames, %lu free, %lu allocs, %lu failed (pool empty)\n",
+                pool->name, pool->total, pool->free, pool->allocs, pool->failures);
+    }
+}
+
+void test_hugepage(void) {
+    kprintf("\n=== Testing huge page pools ===\n");
+
+    // 2MB: map a pool frame, touch both ends, check the translation. The
+    // 1GB test below uses the next 1GB slot, whose PDPT entry is still free.
+    uint64_t virt = 0x7000000000;
+    uint64_t virt_1g = virt + HUGE_PAGE_1G_SIZE;
+    void *frame = hugepage_alloc(HUGEPAGE_2M);
+    if (!frame) {
+        kprintf("2MB pool empty, skipping\n");
+    } else if (hugepage_map(kernel_pml4, virt, frame, HUGEPAGE_2M, PTE_KERNEL_DATA)) {
+        volatile uint64_t *head = (uint64_t *)virt;
+        volatile uint64_t *tail = (uint64_t *)(virt + LARGE_PAGE_SIZE - sizeof(uint64_t));
+        *head = 0x2222222222222222;
+        *tail = 0x3333333333333333;
+        uint64_t phys = vmm_get_physical_address(kernel_pml4, virt + 0x12345);
+
+        kprintf("2MB page at 0x%lx: read back %s, translation %s\n", (uintptr_t)frame,
+                *head == 0x2222222222222222 && *tail == 0x3333333333333333 ? "y" : "n",
+                phys == (uintptr_t)frame + 0x12345 ? "y" : "n");
+
+        hugepage_unmap(kernel_pml4, virt, HUGEPAGE_2M);
+        kprintf("Unmapped: %s\n", vmm_get_physical_address(kernel_pml4, virt) ? "n" : "y");
+    }
+    if (frame) {
+        hugepage_free(frame, HUGEPAGE_2M);
+    }
+
+    // 1GB: reserve one at runtime, which needs 1GB of aligned free memory.
+    // Below about 2GB that can't work, and trying would bring every deferred
+    // section online and log an allocation failure.
+    #define TEST_1G_MIN_MEMORY (2 * HUGE_PAGE_1G_SIZE)
+    if (pmm_get_total_memory() < TEST_1G_MIN_MEMORY) {
+        kprintf("Only %lu MB of RAM, skipping the 1GB test\n",
+                pmm_get_total_memory() / (1024 * 1024));
+    } else if (hugepage_reserve(HUGEPAGE_1G, 1) == 1) {
+        frame = hugepage_alloc(HUGEPAGE_1G);
+        if (hugepage_map(kernel_pml4, virt_1g, frame, HUGEPAGE_1G, PTE_KERNEL_DATA)) {
+            volatile uint64_t *tail = (uint64_t *)(virt_1g + HUGE_PAGE_1G_SIZE - sizeof(uint64_t));
+            *tail = 0x4444444444444444;
+            uint64_t phys = vmm_get_physical_address(kernel_pml4, virt_1g + 0x23456789);
+
+            kprintf("1GB page at 0x%lx: read back %s, translation %s\n", (uintptr_t)frame,
+                    *tail == 0x4444444444444444 ? "y" : "n",
+                    phys == (uintptr_t)frame + 0x23456789 ? "y" : "n");
+            hugepage_unmap(kernel_pml4, virt_1g, HUGEPAGE_1G);
+        }
+        hugepage_free(frame, HUGEPAGE_1G);
+        hugepage_shrink(HUGEPAGE_1G, 1);
+    } else {
+        kprintf("No 1GB frame available, skipping\n");
+    }
+
+    hugepage_print_stats();
+    kprintf("Huge page tests complete!\n\n");
+}
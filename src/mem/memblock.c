@@ -0,0 +1,178 @@
+// Early boot memory: a sorted list of usable regions and a sorted list of
+// reservations carved out of them, used until the PMM takes over
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limine.h>
+#include <kprintf.h>
+#include <memblock.h>
+#include <mm_constants.h>
+
+typedef struct {
+    memblock_region_t regions[MEMBLOCK_MAX_REGIONS];
+    size_t count;
+} memblock_type_t;
+
+static memblock_type_t memory;
+static memblock_type_t reserved;
+static bool memblock_closed = false;
+
+// Insert [base, base + size) keeping the list sorted and merging it with
+// any region it touches or overlaps
+static bool region_add(memblock_type_t *type, uint64_t base, uint64_t size) {
+    uint64_t end = base + size;
+    size_t i = 0;
+
+    while (i < type->count && type->regions[i].base + type->regions[i].size < base) {
+        i++;
+    }
+
+    // Swallow every region from i on that overlaps or touches the new one
+    size_t j = i;
+    while (j < type->count && type->regions[j].base <= end) {
+        uint64_t r_end = type->regions[j].base + type->regions[j].size;
+        if (type->regions[j].base < base) base = type->regions[j].base;
+        if (r_end > end) end = r_end;
+        j++;
+    }
+
+    if (j == i) {
+        if (type->count >= MEMBLOCK_MAX_REGIONS) {
+            return false;
+        }
+        for (size_t k = type->count; k > i; k--) {
+            type->regions[k] = type->regions[k - 1];
+        }
+        type->count++;
+    } else if (j > i + 1) {
+        for (size_t k = j; k < type->count; k++) {
+            type->regions[k - (j - i - 1)] = type->regions[k];
+        }
+        type->count -= j - i - 1;
+    }
+
+    type->regions[i].base = base;
+    type->regions[i].size = end - base;
+    return true;
+}
+
+// First reservation overlapping [base, base + size), or NULL
+static const memblock_region_t *reserved_overlap(uint64_t base, uint64_t size) {
+    for (size_t i = 0; i < reserved.count; i++) {
+        const memblock_region_t *r = &reserved.regions[i];
+        if (r->base >= base + size) break;
+        if (r->base + r->size > base) return r;
+    }
+    return NULL;
+}
+
+void memblock_init(struct limine_memmap_response *memmap) {
+    memory.count = 0;
+    reserved.count = 0;
+    memblock_closed = false;
+
+    if (!memmap) {
+        kprintf("Memblock Error: No memory map\n");
+        return;
+    }
+
+    for (size_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry *e = memmap->entries[i];
+        if (e->type != LIMINE_MEMMAP_USABLE || !e->length) continue;
+
+        if (!region_add(&memory, e->base, e->length)) {
+            kprintf("Memblock Warning: Too many usable regions, ignoring 0x%lx\n", e->base);
+        }
+    }
+
+    // Real mode structures and firmware data live there
+    memblock_reserve(0, FIRST_MB_BYTES);
+}
+
+bool memblock_reserve(uint64_t base, uint64_t size) {
+    if (memblock_closed) {
+        kprintf("Memblock Error: Reserve of 0x%lx after handover\n", base);
+        return false;
+    }
+    if (!size) {
+        return true;
+    }
+
+    if (!region_add(&reserved, base, size)) {
+        kprintf("Memblock Error: Reservation table full at 0x%lx\n", base);
+        return false;
+    }
+    return true;
+}
+
+uint64_t memblock_find_range(uint64_t size, uint64_t align, uint64_t min_addr,
+                             uint64_t max_addr, bool top_down) {
+    if (memblock_closed || !size || align & (align - 1)) {
+        return 0;
+    }
+    if (!align) {
+        align = 1;
+    }
+
+    for (size_t n = 0; n < memory.count; n++) {
+        const memblock_region_t *m = &memory.regions[top_down ? memory.count - 1 - n : n];
+        uint64_t low = m->base > min_addr ? m->base : min_addr;
+        uint64_t high = m->base + m->size < max_addr ? m->base + m->size : max_addr;
+        if (low >= high || high - low < size) continue;
+
+        if (top_down) {
+            uint64_t candidate = (high - size) & ~(align - 1);
+            while (candidate >= low) {
+                const memblock_region_t *r = reserved_overlap(candidate, size);
+                if (!r) return candidate;
+                // Retry just below the reservation
+                if (r->base < low + size) break;
+                candidate = (r->base - size) & ~(align - 1);
+            }
+        } else {
+            uint64_t candidate = (low + align - 1) & ~(align - 1);
+            while (candidate + size <= high && candidate >= low) {
+                const memblock_region_t *r = reserved_overlap(candidate, size);
+                if (!r) return candidate;
+                candidate = (r->base + r->size + align - 1) & ~(align - 1);
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Reserve size bytes found from the bottom (or top) of memory. ZONE_DMA
+// is kept for devices that need it, unless nothing else fits.
+static uint64_t alloc_range(uint64_t size, uint64_t align, bool top_down) {
+    if (memblock_closed) {
+        kprintf("Memblock Error: Allocation of %lu bytes after handover\n", size);
+        return 0;
+    }
+
+    uint64_t base = memblock_find_range(size, align, ZONE_DMA_LIMIT, UINT64_MAX, top_down);
+    if (!base) {
+        base = memblock_find_range(size, align, FIRST_MB_BYTES, UINT64_MAX, top_down);
+    }
+
+    if (!base || !memblock_reserve(base, size)) {
+        kprintf("Memblock Error: Failed to allocate %lu bytes\n", size);
+        return 0;
+    }
+    return base;
+}
+
+uint64_t memblock_alloc(uint64_t size, uint64_t align) {
+    return alloc_range(size, align, false);
+}
+
+uint64_t memblock_alloc_high(uint64_t size, uint64_t align) {
+    return alloc_range(size, align, true);
+}
+
+size_t memblock_handover(const memblock_region_t **regions) {
+    memblock_closed = true;
+    *regions = reserved.regions;
+    return reserved.count;
+}
@@ -0,0 +1,197 @@
+// NUMA topology from the ACPI SRAT (affinity) and SLIT (distances)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <kprintf.h>
+#include <acpi.h>
+#include <cpu.h>
+#include <numa.h>
+
+typedef struct {
+    uint64_t base;
+    uint64_t end;
+    uint8_t node;
+} numa_range_t;
+
+// Memory ranges sorted by base address
+static numa_range_t ranges[NUMA_MAX_RANGES];
+static size_t range_count = 0;
+
+// Nodes are numbered densely in the order the SRAT first mentions them;
+// node_pxm maps them back to ACPI proximity domains for the SLIT
+static uint32_t node_pxm[NUMA_MAX_NODES];
+static size_t node_count = 1;
+
+static uint8_t distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static uint8_t node_order[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+uint8_t numa_cpu_node[MAX_CPUS];
+
+// Node number for a proximity domain, adding it if new. -1 if out of room.
+static int node_for_pxm(uint32_t pxm, size_t *count) {
+    for (size_t i = 0; i < *count; i++) {
+        if (node_pxm[i] == pxm) return i;
+    }
+
+    if (*count >= NUMA_MAX_NODES) {
+        kprintf("NUMA Warning: More than %d proximity domains, ignoring domain %u\n",
+                NUMA_MAX_NODES, pxm);
+        return -1;
+    }
+
+    node_pxm[*count] = pxm;
+    return (*count)++;
+}
+
+static void add_range(uint64_t base, uint64_t length, int node) {
+    if (range_count >= NUMA_MAX_RANGES) {
+        kprintf("NUMA Warning: Too many memory affinity ranges, ignoring 0x%lx\n", base);
+        return;
+    }
+
+    // Insertion sort keeps lookups a simple scan
+    size_t i = range_count++;
+    while (i > 0 && ranges[i - 1].base > base) {
+        ranges[i] = ranges[i - 1];
+        i--;
+    }
+    ranges[i].base = base;
+    ranges[i].end = base + length;
+    ranges[i].node = node;
+}
+
+static void parse_srat(struct acpi_srat *srat, uint8_t bsp_apic_id) {
+    size_t nodes = 0;
+    uint8_t *pos = (uint8_t *)(srat + 1);
+    uint8_t *end = (uint8_t *)srat + srat->header.length;
+
+    while (pos + sizeof(struct acpi_srat_entry) <= end) {
+        struct acpi_srat_entry *entry = (struct acpi_srat_entry *)pos;
+        if (entry->length < sizeof(struct acpi_srat_entry) || pos + entry->length > end) {
+            kprintf("NUMA Error: Malformed SRAT entry at offset %lu\n",
+                    (uintptr_t)(pos - (uint8_t *)srat));
+            break;
+        }
+
+        if (entry->type == SRAT_TYPE_MEMORY_AFFINITY) {
+            struct acpi_srat_memory_affinity *mem = (struct acpi_srat_memory_affinity *)entry;
+            if ((mem->flags & SRAT_FLAG_ENABLED) && mem->length_bytes) {
+                int node = node_for_pxm(mem->proximity_domain, &nodes);
+                if (node >= 0) add_range(mem->base, mem->length_bytes, node);
+            }
+        } else if (entry->type == SRAT_TYPE_CPU_AFFINITY) {
+            struct acpi_srat_cpu_affinity *cpu = (struct acpi_srat_cpu_affinity *)entry;
+            if (cpu->flags & SRAT_FLAG_ENABLED) {
+                uint32_t pxm = cpu->proximity_domain_lo |
+                               (uint32_t)cpu->proximity_domain_hi[0] << 8 |
+                               (uint32_t)cpu->proximity_domain_hi[1] << 16 |
+                               (uint32_t)cpu->proximity_domain_hi[2] << 24;
+                int node = node_for_pxm(pxm, &nodes);
+                // Only the BSP runs until SMP bring-up exists
+                if (node >= 0 && cpu->apic_id == bsp_apic_id) numa_cpu_node[0] = node;
+            }
+        } else if (entry->type == SRAT_TYPE_X2APIC_AFFINITY) {
+            struct acpi_srat_x2apic_affinity *cpu = (struct acpi_srat_x2apic_affinity *)entry;
+            if (cpu->flags & SRAT_FLAG_ENABLED) {
+                int node = node_for_pxm(cpu->proximity_domain, &nodes);
+                if (node >= 0 && cpu->x2apic_id == bsp_apic_id) numa_cpu_node[0] = node;
+            }
+        }
+
+        pos += entry->length;
+    }
+
+    if (nodes) node_count = nodes;
+}
+
+static void parse_slit(struct acpi_slit *slit) {
+    uint64_t n = slit->localities;
+
+    if (sizeof(struct acpi_slit) + n * n > slit->header.length) {
+        kprintf("NUMA Error: SLIT too short for %lu localities\n", n);
+        return;
+    }
+
+    for (size_t a = 0; a < node_count; a++) {
+        for (size_t b = 0; b < node_count; b++) {
+            if (node_pxm[a] < n && node_pxm[b] < n) {
+                distances[a][b] = slit->distances[node_pxm[a] * n + node_pxm[b]];
+            }
+        }
+    }
+}
+
+void numa_init(void) {
+    for (size_t a = 0; a < NUMA_MAX_NODES; a++) {
+        for (size_t b = 0; b < NUMA_MAX_NODES; b++) {
+            distances[a][b] = a == b ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+
+    struct acpi_srat *srat = (struct acpi_srat *)acpi_find_table("SRAT");
+    if (srat) {
+        parse_srat(srat, ebx >> 24);
+    }
+
+    struct acpi_slit *slit = (struct acpi_slit *)acpi_find_table("SLIT");
+    if (slit && node_count > 1) {
+        parse_slit(slit);
+    }
+
+    // Fallback order per node: every node sorted by distance, ties by number
+    for (size_t n = 0; n < node_count; n++) {
+        for (size_t i = 0; i < node_count; i++) {
+            size_t j = i;
+            while (j > 0 && distances[n][node_order[n][j - 1]] > distances[n][i]) {
+                node_order[n][j] = node_order[n][j - 1];
+                j--;
+            }
+            node_order[n][j] = i;
+        }
+    }
+
+    if (!srat) {
+        kprintf("NUMA: No SRAT, single node\n");
+        return;
+    }
+
+    kprintf("NUMA: %lu nodes, boot CPU on node %d\n", node_count, numa_cpu_node[0]);
+    for (size_t i = 0; i < range_count; i++) {
+        kprintf("  Node %d: 0x%lx-0x%lx\n", ranges[i].node, ranges[i].base, ranges[i].end);
+    }
+    for (size_t a = 0; a < node_count && slit; a++) {
+        kprintf("  Distances from node %lu:", a);
+        for (size_t b = 0; b < node_count; b++) {
+            kprintf(" %d", distances[a][b]);
+        }
+        kprintf("\n");
+    }
+}
+
+size_t numa_node_count(void) {
+    return node_count;
+}
+
+int numa_node_of_phys(uint64_t phys) {
+    int node = 0;
+
+    for (size_t i = 0; i < range_count && ranges[i].base <= phys; i++) {
+        node = ranges[i].node;
+    }
+    return node;
+}
+
+uint8_t numa_distance(int from, int to) {
+    if (from < 0 || to < 0 || from >= NUMA_MAX_NODES || to >= NUMA_MAX_NODES) {
+        return 0xFF;
+    }
+    return distances[from][to];
+}
+
+const uint8_t *numa_node_order(int node) {
+    return node_order[node];
+}
@@ -8,272 +8,1056 @@
 #include <pmm.h>
 #include <slab.h>
 #include <mm_constants.h>
+#include <cpu.h>
+#include <vmm.h>
+#include <numa.h>
+#include <memblock.h>
+#include <acpi.h>
 
-static uint8_t *bitmap = NULL;
-static size_t bitmap_size = 0;
+// Used/free bitmap (1 = used), bitmap_words 64-bit words over all pages
+// below highest_addr. The words live in their section, see below.
+static size_t bitmap_words = 0;
+
+// Summary levels over the bitmap for range searches. Level 1 has a bit per
+// 64-page bitmap word, level 2 a bit per level-1 word (4096 pages). The
+// has_free levels mark groups with at least one free page, the all_free
+// levels groups that are entirely free.
+static uint64_t *l1_has_free = NULL;
+static uint64_t *l1_all_free = NULL;
+static uint64_t *l2_has_free = NULL;
+static uint64_t *l2_all_free = NULL;
+static size_t l1_words = 0;
+static size_t l2_words = 0;
 static size_t total_pages = 0;
 static uintptr_t highest_addr = 0;
 static uintptr_t hhdm_offset = 0;
 static SPIN_LOCK pmm_lock = {0};
-static uint16_t *page_refcounts = NULL;
+static uint64_t pmm_lock_count = 0;
+
+// One descriptor per frame. Free lists are linked through the descriptors,
+// so freeing and coalescing never touch the frames themselves. The bitmap is
+// kept alongside as a dense used/free index for range scans.
+//
+// Both are split into PMM_SECTION_PAGES sections, and only sections holding
+// usable (or reclaimable) memory get any, packed one after the other. Holes
+// between RAM ranges cost a section table entry, not metadata. Bitmap words
+// of absent sections read from a shared all-used block, so scans need no
+// special case; descriptors of absent sections don't exist (pfn_valid).
+//
+// Past the first PMM_EARLY_INIT_BYTES of each node, present sections are
+// left deferred: their slot is reserved and their bitmap reads all-used,
+// but descriptors and free lists are only set up later (section_online).
+typedef struct {
+    struct page *pages;     // PMM_SECTION_PAGES descriptors, NULL if absent or deferred
+    uint64_t *bitmap;       // PMM_SECTION_WORDS words
+} mem_section_t;
+
+static mem_section_t *sections = NULL;
+static size_t section_count = 0;
+static size_t present_sections = 0;
+// Section number of each packed slot, for descriptor to page index
+static uint32_t *slot_section = NULL;
+static struct page *page_array = NULL;
+static uint64_t absent_bitmap[PMM_SECTION_WORDS];
+
+_Static_assert(sizeof(struct page) == 32, "struct page must stay 32 bytes");
+
+typedef struct {
+    size_t start;
+    size_t end;
+} page_range_t;
+
+// A physical memory zone. Zone limits are multiples of the largest buddy
+// block, so a block and its buddy always live in the same zone.
+typedef struct {
+    const char *name;
+    size_t start_page;
+    size_t end_page;
+    size_t managed_pages;
+    // One set of buddy lists per NUMA node, so node-local allocation is a
+    // list pop like any other
+    struct page *free_lists[NUMA_MAX_NODES][PMM_MAX_ORDER + 1];
+    // Free accounting over all nodes, kept in step with the free lists so
+    // stats are O(1)
+    size_t free_block_counts[PMM_MAX_ORDER + 1];
+    size_t free_page_count;
+    // Fallback allocations from a higher zone may not push this zone below
+    // watermark_low; background work only takes frames above watermark_high
+    size_t watermark_low;
+    size_t watermark_high;
+} pmm_zone_t;
+
+static pmm_zone_t zones[PMM_ZONE_COUNT] = {
+    [ZONE_DMA]    = { .name = "DMA" },
+    [ZONE_DMA32]  = { .name = "DMA32" },
+    [ZONE_NORMAL] = { .name = "Normal" },
+    [ZONE_CMA]    = { .name = "CMA" },
+};
+
+// Per-node totals. Node boundaries are rounded to the largest buddy block
+// like zone limits, so a block and its buddy always share a node.
+typedef struct {
+    size_t managed_pages;
+    size_t free_page_count;
+    uint64_t local_allocs;      // served by the node that was asked for
+    uint64_t remote_allocs;     // fell back to a more distant node
+} pmm_node_t;
+
+static pmm_node_t nodes[NUMA_MAX_NODES];
+
+// Zone ordinary allocations come from: the highest zone that has memory
+static int default_zone = ZONE_DMA32;
+
+// Total over all zones
+static size_t free_page_count = 0;
+
+// Bootloader/ACPI reclaimable ranges, copied out of the Limine memmap so
+// they can be handed to the buddy system after the memmap itself is gone
+#define PMM_MAX_RECLAIM_RANGES 64
+static page_range_t reclaim_ranges[PMM_MAX_RECLAIM_RANGES];
+static size_t reclaim_range_count = 0;
+static bool boot_memory_reclaimed = false;
+
+// Usable ranges, also copied out of the memmap, and the ranges inside them
+// that never go on the free lists, for bringing deferred sections online
+#define PMM_MAX_USABLE_RANGES 128
+static page_range_t usable_ranges[PMM_MAX_USABLE_RANGES];
+static size_t usable_range_count = 0;
+static page_range_t boot_reserved[MEMBLOCK_MAX_REGIONS];
+static size_t boot_reserved_count = 0;
+
+// Deferred sections left, the usable pages in them (free, but not on the
+// free lists yet), the packed slot to look at next and the time spent
+// bringing them online
+static size_t deferred_sections = 0;
+static size_t deferred_pages = 0;
+static size_t deferred_total = 0;
+static size_t deferred_slot = 0;
+static uint64_t deferred_cycles = 0;
+
+// Pages handed back by exact-size allocations instead of being lost to
+// power-of-two rounding
+static size_t exact_pages_saved = 0;
+
+// Per-CPU cache of order-0 frames. Frames sitting here are allocated as far
+// as the buddy system is concerned. Recently freed frames go on the hot list
+// (likely still in cache), batch refills from the buddy lists go on the cold
+// list. Only the owning CPU touches its cache, with interrupts disabled.
+// Cached frames carry PAGE_FLAG_PCP, so freeing one again is caught.
+typedef struct {
+    uintptr_t hot[PCP_HIGH];
+    size_t hot_count;
+    uintptr_t cold[PCP_BATCH];
+    size_t cold_count;
+    uint64_t hits;
+    uint64_t refills;
+    uint64_t drains;
+} pcp_cache_t;
+
+// MAX_CPUS caches in one block from memblock, set up by pmm_init
+static pcp_cache_t *pcp_caches = NULL;
+
+// Frames zeroed ahead of time by pmm_idle_work. Like the per-CPU caches
+// they are allocated as far as the buddy system is concerned.
+static uintptr_t zero_pool[ZERO_POOL_SIZE];
+static size_t zero_pool_count = 0;
+static SPIN_LOCK zero_pool_lock = {0};
+static uint64_t zero_pool_hits = 0;
+static uint64_t zero_pool_misses = 0;
+
+// Compaction: callbacks that give back cached pages, and counters
+static pmm_shrinker_t shrinkers[PMM_MAX_SHRINKERS];
+static size_t shrinker_count = 0;
+static uint64_t compact_runs = 0;
+static uint64_t compact_successes = 0;
+static uint64_t pages_migrated = 0;
+// free_page_count when idle compaction last failed; not retried until it changes
+static size_t compact_idle_skip = SIZE_MAX;
+
+static void run_shrinkers(void);
+static bool compact_zones(int zone_index, size_t order);
+static int fragmentation_index(size_t order);
+
+static inline void pmm_lock_acquire(void) {
+    spin_lock(&pmm_lock);
+    pmm_lock_count++;
+}
+
+static inline void pmm_lock_release(void) {
+    spin_unlock(&pmm_lock);
+}
+
+// Mask of bits [from, to) inside one 64-bit bitmap word
+static inline uint64_t word_mask(size_t from, size_t to) {
+    uint64_t high = (to == 64) ? ~0UL : ((1UL << to) - 1);
+    return high & ~((1UL << from) - 1);
+}
+
+// Bitmap word w, in whichever section holds it
+static inline uint64_t *bitmap_word(size_t w) {
+    return &sections[w / PMM_SECTION_WORDS].bitmap[w % PMM_SECTION_WORDS];
+}
+
+static inline void summary_put(uint64_t *level, size_t index, bool value) {
+    uint64_t bit = 1UL << (index % 64);
+    level[index / 64] = value ? (level[index / 64] | bit) : (level[index / 64] & ~bit);
+}
 
-typedef struct free_block {
-    struct free_block *next;
-    struct free_block *prev;
-} free_block_t;
+static inline void summary_update_l2(size_t g) {
+    summary_put(l2_has_free, g, l1_has_free[g] != 0);
+    summary_put(l2_all_free, g, l1_all_free[g] == ~0UL);
+}
+
+// Recompute the summaries for bitmap words [first, last]
+static void summary_refresh(size_t first, size_t last) {
+    for (size_t w = first; w <= last; w++) {
+        uint64_t word = *bitmap_word(w);
+        summary_put(l1_has_free, w, word != ~0UL);
+        summary_put(l1_all_free, w, word == 0);
+    }
+    for (size_t g = first / 64; g <= last / 64; g++) {
+        summary_update_l2(g);
+    }
+}
 
-static free_block_t *free_lists[PMM_MAX_ORDER + 1];
+// Bitmap words [first, last] were all just set to used (or all to free):
+// update their summary bits a level-1 word at a time
+static void summary_fill(size_t first, size_t last, bool used) {
+    for (size_t g = first / 64; g <= last / 64; g++) {
+        size_t from = (g == first / 64) ? first % 64 : 0;
+        size_t to = (g == last / 64) ? last % 64 + 1 : 64;
+        uint64_t mask = word_mask(from, to);
+        
+        if (used) {
+            l1_has_free[g] &= ~mask;
+            l1_all_free[g] &= ~mask;
+        } else {
+            l1_has_free[g] |= mask;
+            l1_all_free[g] |= mask;
+        }
+        summary_update_l2(g);
+    }
+}
 
 // Helper functions for bitmap manipulation
 void bitmap_set(size_t bit) { 
-    bitmap[bit / 8] |= (1 << (bit % 8)); 
+    *bitmap_word(bit / 64) |= 1UL << (bit % 64); 
+    summary_refresh(bit / 64, bit / 64);
 }
 
 void bitmap_unset(size_t bit) { 
-    bitmap[bit / 8] &= ~(1 << (bit % 8)); 
+    *bitmap_word(bit / 64) &= ~(1UL << (bit % 64)); 
+    summary_refresh(bit / 64, bit / 64);
 }
 
 bool bitmap_test(size_t bit) { 
-    return bitmap[bit / 8] & (1 << (bit % 8)); 
+    return *bitmap_word(bit / 64) & (1UL << (bit % 64)); 
 }
 
-// Get buddy index for a page at given order
-static inline size_t get_buddy_index(size_t page_index, size_t order) {
-    return page_index ^ (1 << order);
+// Set or clear bits [start, start + count). Partial words at either end are
+// masked, everything in between is filled with memset a section at a time.
+static void bitmap_fill_range(size_t start, size_t count, bool set) {
+    if (count == 0) return;
+    
+    size_t end = start + count;
+    size_t first = start / 64;
+    size_t last = (end - 1) / 64;
+    uint64_t *word = bitmap_word(first);
+    
+    if (first == last) {
+        uint64_t mask = word_mask(start % 64, (end - 1) % 64 + 1);
+        *word = set ? (*word | mask) : (*word & ~mask);
+        summary_refresh(first, last);
+        return;
+    }
+    
+    uint64_t head = word_mask(start % 64, 64);
+    uint64_t tail = word_mask(0, (end - 1) % 64 + 1);
+    *word = set ? (*word | head) : (*word & ~head);
+    word = bitmap_word(last);
+    *word = set ? (*word | tail) : (*word & ~tail);
+    for (size_t w = first + 1; w < last; ) {
+        size_t stop = (w / PMM_SECTION_WORDS + 1) * PMM_SECTION_WORDS;
+        if (stop > last) stop = last;
+        memset(bitmap_word(w), set ? 0xFF : 0, (stop - w) * sizeof(uint64_t));
+        w = stop;
+    }
+    summary_refresh(first, first);
+    summary_refresh(last, last);
+    if (last - first > 1) {
+        summary_fill(first + 1, last - 1, set);
+    }
 }
 
-// Check if a block is free (all pages in block are unset in bitmap)
-static bool is_block_free(size_t page_index, size_t order) {
-    size_t pages = 1 << order;
-    for (size_t i = 0; i < pages; i++) {
-        if (bitmap_test(page_index + i)) {
-            return false;
+void bitmap_set_range(size_t start, size_t count) {
+    bitmap_fill_range(start, count, true);
+}
+
+void bitmap_clear_range(size_t start, size_t count) {
+    bitmap_fill_range(start, count, false);
+}
+
+// POPCNT is not part of baseline x86-64 and there is no libgcc to fall back
+// on, so use the instruction when CPUID reports it and SWAR otherwise
+static bool have_popcnt = false;
+
+static inline size_t popcount64(uint64_t x) {
+    if (have_popcnt) {
+        uint64_t count;
+        asm("popcnt %1, %0" : "=r"(count) : "rm"(x));
+        return count;
+    }
+    x = x - ((x >> 1) & 0x5555555555555555UL);
+    x = (x & 0x3333333333333333UL) + ((x >> 2) & 0x3333333333333333UL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FUL;
+    return (x * 0x0101010101010101UL) >> 56;
+}
+
+// Index of the lowest set bit, x must be non-zero (BSF/TZCNT)
+static inline size_t ctz64(uint64_t x) {
+    return __builtin_ctzl(x);
+}
+
+// Number of used pages in [start, start + count)
+size_t bitmap_count_used(size_t start, size_t count) {
+    if (count == 0) return 0;
+    
+    size_t end = start + count;
+    size_t first = start / 64;
+    size_t last = (end - 1) / 64;
+    
+    if (first == last) {
+        return popcount64(*bitmap_word(first) & word_mask(start % 64, (end - 1) % 64 + 1));
+    }
+    
+    size_t used = popcount64(*bitmap_word(first) & word_mask(start % 64, 64));
+    for (size_t w = first + 1; w < last; w++) {
+        used += popcount64(*bitmap_word(w));
+    }
+    return used + popcount64(*bitmap_word(last) & word_mask(0, (end - 1) % 64 + 1));
+}
+
+// True if every page in [start, start + count) is free
+bool bitmap_range_free(size_t start, size_t count) {
+    if (count == 0) return true;
+    
+    size_t end = start + count;
+    size_t first = start / 64;
+    size_t last = (end - 1) / 64;
+    
+    if (first == last) {
+        return !(*bitmap_word(first) & word_mask(start % 64, (end - 1) % 64 + 1));
+    }
+    if (*bitmap_word(first) & word_mask(start % 64, 64)) return false;
+    for (size_t w = first + 1; w < last; w++) {
+        if (*bitmap_word(w)) return false;
+    }
+    return !(*bitmap_word(last) & word_mask(0, (end - 1) % 64 + 1));
+}
+
+// First bit at or after from that is set in l1 (clear, if invert), using l2
+// to skip whole level-1 words. Returns limit if there is none below it.
+static size_t summary_next(const uint64_t *l1, const uint64_t *l2, bool invert,
+                           size_t from, size_t limit) {
+    uint64_t flip = invert ? ~0UL : 0;
+    
+    while (from < limit) {
+        uint64_t bits = (l1[from / 64] ^ flip) >> (from % 64);
+        if (bits) {
+            from += ctz64(bits);
+            break;
+        }
+        
+        // Nothing left in this level-1 word: find the next one with a hit
+        size_t g = from / 64 + 1;
+        if (g * 64 >= limit) return limit;
+        size_t h = g / 64;
+        uint64_t groups = (g % 64) ? (l2[h] ^ flip) >> (g % 64) : (l2[h] ^ flip);
+        while (!groups) {
+            h++;
+            if (h * 64 * 64 >= limit) return limit;
+            g = h * 64;
+            groups = l2[h] ^ flip;
         }
+        from = (g + ctz64(groups)) * 64;
     }
-    return true;
+    return from < limit ? from : limit;
 }
 
-// Mark a block as used in bitmap
-static void mark_block_used(size_t page_index, size_t order) {
-    size_t pages = 1 << order;
-    for (size_t i = 0; i < pages; i++) {
-        bitmap_set(page_index + i);
+// First free page in [pos, end), or end
+static size_t next_free(size_t pos, size_t end) {
+    while (pos < end) {
+        uint64_t bits = ~*bitmap_word(pos / 64) >> (pos % 64);
+        if (bits) {
+            pos += ctz64(bits);
+            break;
+        }
+        pos = summary_next(l1_has_free, l2_has_free, false, pos / 64 + 1, (end + 63) / 64) * 64;
+    }
+    return pos < end ? pos : end;
+}
+
+// First used page in [pos, end), or end
+static size_t next_used(size_t pos, size_t end) {
+    while (pos < end) {
+        uint64_t bits = *bitmap_word(pos / 64) >> (pos % 64);
+        if (bits) {
+            pos += ctz64(bits);
+            break;
+        }
+        pos = summary_next(l1_all_free, l2_all_free, true, pos / 64 + 1, (end + 63) / 64) * 64;
+    }
+    return pos < end ? pos : end;
+}
+
+// Find a run of count free pages in [start, end) starting on a multiple of
+// align pages (a power of two). Walks free runs with the summaries, so used
+// or free stretches cost one step per 4096 pages at worst. First fit returns
+// the lowest run, best fit the shortest free run that fits. Returns SIZE_MAX
+// if nothing fits.
+static size_t find_run(size_t start, size_t end, size_t count, size_t align, bool best_fit) {
+    size_t best = SIZE_MAX;
+    size_t best_len = SIZE_MAX;
+    size_t pos = start;
+    
+    while (pos < end) {
+        pos = next_free(pos, end);
+        if (pos >= end) break;
+        
+        size_t run_end = next_used(pos, end);
+        size_t aligned = (pos + align - 1) & ~(align - 1);
+        
+        if (aligned < run_end && run_end - aligned >= count) {
+            if (!best_fit) return aligned;
+            if (run_end - pos < best_len) {
+                best = aligned;
+                best_len = run_end - pos;
+                if (best_len == count) break;
+            }
+        }
+        pos = run_end;
     }
+    return best;
+}
+
+// First fit run of count free pages aligned to align pages, or SIZE_MAX
+size_t bitmap_find_free_run(size_t start, size_t end, size_t count, size_t align) {
+    return find_run(start, end, count, align, false);
+}
+
+// Get buddy index for a page at given order
+static inline size_t get_buddy_index(size_t page_index, size_t order) {
+    return page_index ^ (1 << order);
+}
+
+// Mark a block as used in bitmap
+static inline void mark_block_used(size_t page_index, size_t order) {
+    bitmap_set_range(page_index, 1UL << order);
 }
 
 // Mark a block as free in bitmap
-static void mark_block_free(size_t page_index, size_t order) {
-    size_t pages = 1 << order;
-    for (size_t i = 0; i < pages; i++) {
-        bitmap_unset(page_index + i);
+static inline void mark_block_free(size_t page_index, size_t order) {
+    bitmap_clear_range(page_index, 1UL << order);
+}
+
+// Check that every page of a block is free in the bitmap
+static inline bool is_block_free(size_t page_index, size_t order) {
+    return bitmap_range_free(page_index, 1UL << order);
+}
+
+// Convert between a page index and its descriptor. The page must be in a
+// present section (pfn_valid); every page that was ever free is.
+static inline struct page *index_to_page(size_t page_index) {
+    return &sections[page_index >> PMM_SECTION_SHIFT].pages[page_index & (PMM_SECTION_PAGES - 1)];
+}
+
+static inline size_t page_to_index(struct page *page) {
+    size_t packed = page - page_array;
+    return ((size_t)slot_section[packed >> PMM_SECTION_SHIFT] << PMM_SECTION_SHIFT) |
+           (packed & (PMM_SECTION_PAGES - 1));
+}
+
+// True if page_index has a descriptor
+static inline bool pfn_valid(size_t page_index) {
+    return page_index < total_pages && sections[page_index >> PMM_SECTION_SHIFT].pages;
+}
+
+// Check if page_index heads a free block of exactly this order
+static inline bool is_free_head(size_t page_index, size_t order) {
+    struct page *page = index_to_page(page_index);
+    return (page->flags & PAGE_FLAG_FREE) && page->order == order;
+}
+
+static inline int page_zone_index(size_t page_index) {
+    if (page_index < ZONE_DMA_LIMIT / PAGE_SIZE) {
+        return ZONE_DMA;
     }
+    if (page_index < ZONE_DMA32_LIMIT / PAGE_SIZE) {
+        return ZONE_DMA32;
+    }
+    return ZONE_NORMAL;
+}
+
+static inline pmm_zone_t *page_zone(size_t page_index) {
+    return &zones[index_to_page(page_index)->zone];
 }
 
 // Add block to free list
 static void add_to_free_list(size_t page_index, size_t order) {
-    void *block_virt = (void *)(page_index * PAGE_SIZE + hhdm_offset);
-    free_block_t *block = (free_block_t *)block_virt;
+    struct page *page = index_to_page(page_index);
+    pmm_zone_t *zone = &zones[page->zone];
+    
+    struct page **list = &zone->free_lists[page->node][order];
     
-    block->next = free_lists[order];
-    block->prev = NULL;
+    page->next = *list;
+    page->prev = NULL;
     
-    if (free_lists[order]) {
-        free_lists[order]->prev = block;
+    if (*list) {
+        (*list)->prev = page;
     }
     
-    free_lists[order] = block;
+    *list = page;
+    page->flags = PAGE_FLAG_FREE;
+    page->order = order;
+    page->private = NULL;
+    zone->free_block_counts[order]++;
+    zone->free_page_count += 1UL << order;
+    nodes[page->node].free_page_count += 1UL << order;
+    free_page_count += 1UL << order;
 }
 
 // Remove block from free list
-static void remove_from_free_list(free_block_t *block, size_t order) {
-    if (block->prev) {
-        block->prev->next = block->next;
+static void remove_from_free_list(struct page *page, size_t order) {
+    pmm_zone_t *zone = &zones[page->zone];
+    
+    if (page->prev) {
+        page->prev->next = page->next;
     } else {
-        free_lists[order] = block->next;
+        zone->free_lists[page->node][order] = page->next;
+    }
+    
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+
+    page->next = page->prev = NULL;
+    page->flags &= ~PAGE_FLAG_FREE;
+    page->order = 0;
+    zone->free_block_counts[order]--;
+    zone->free_page_count -= 1UL << order;
+    nodes[page->node].free_page_count -= 1UL << order;
+    free_page_count -= 1UL << order;
+}
+
+// Count [start, end) as memory managed by the nodes it falls in. Nodes only
+// change on largest-block boundaries.
+static void node_account_range(size_t start, size_t end) {
+    while (start < end) {
+        size_t limit = (start | (PMM_MAX_CONTIGUOUS_PAGES - 1)) + 1;
+        if (limit > end) {
+            limit = end;
+        }
+        nodes[index_to_page(start)->node].managed_pages += limit - start;
+        start = limit;
+    }
+}
+
+// Count [start, end) as memory managed by the zones (and nodes) it falls in
+static void zone_account_range(size_t start, size_t end) {
+    pmm_zone_t *cma = &zones[ZONE_CMA];
+    
+    node_account_range(start, end);
+    
+    while (start < end) {
+        pmm_zone_t *zone = page_zone(start);
+        size_t limit = end < zone->end_page ? end : zone->end_page;
+        // The CMA zone sits inside one of the address zones
+        if (zone != cma && start < cma->start_page && limit > cma->start_page) {
+            limit = cma->start_page;
+        }
+        zone->managed_pages += limit - start;
+        start = limit;
+    }
+}
+
+
+// Recompute watermarks from managed memory and pick the default zone
+static void zone_setup_watermarks(void) {
+    default_zone = ZONE_DMA;
+    
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+        pmm_zone_t *zone = &zones[z];
+        size_t low = zone->managed_pages / ZONE_WATERMARK_RATIO;
+        
+        if (low < ZONE_WATERMARK_MIN_PAGES) {
+            low = ZONE_WATERMARK_MIN_PAGES;
+        }
+        if (low > zone->managed_pages) {
+            low = zone->managed_pages;
+        }
+        
+        zone->watermark_low = low;
+        zone->watermark_high = low * 2;
+        
+        if (zone->managed_pages && z != ZONE_CMA) {
+            default_zone = z;
+        }
+    }
+}
+
+// Add [start, end) to the free lists as the largest naturally aligned blocks
+// that fit, without looking at the bitmap
+static void add_free_range(size_t start, size_t end) {
+    while (start < end) {
+        size_t order = start ? (size_t)__builtin_ctzl(start) : PMM_MAX_ORDER;
+        if (order > PMM_MAX_ORDER) {
+            order = PMM_MAX_ORDER;
+        }
+        while ((1UL << order) > end - start) {
+            order--;
+        }
+        add_to_free_list(start, order);
+        start += 1UL << order;
+    }
+}
+
+// Free [start, end) minus any overlap with the reserved ranges, in the
+// bitmap and on the free lists
+static void add_usable_range(size_t start, size_t end, const page_range_t *reserved, size_t count) {
+    for (size_t i = 0; i < count && start < end; i++) {
+        if (reserved[i].end <= start || reserved[i].start >= end) {
+            continue;
+        }
+        if (reserved[i].start > start) {
+            add_usable_range(start, reserved[i].start, reserved + i + 1, count - i - 1);
+        }
+        start = reserved[i].end;
+    }
+    
+    if (start < end) {
+        bitmap_clear_range(start, end - start);
+        add_free_range(start, end);
+        zone_account_range(start, end);
+    }
+}
+
+// Pages add_usable_range would free for [start, end)
+static size_t count_usable_range(size_t start, size_t end, const page_range_t *reserved,
+                                 size_t count) {
+    size_t pages = 0;
+    for (size_t i = 0; i < count && start < end; i++) {
+        if (reserved[i].end <= start || reserved[i].start >= end) {
+            continue;
+        }
+        if (reserved[i].start > start) {
+            pages += count_usable_range(start, reserved[i].start, reserved + i + 1, count - i - 1);
+        }
+        start = reserved[i].end;
+    }
+    
+    return start < end ? pages + end - start : pages;
+}
+
+// Find the highest spot for a contiguous area of size bytes inside one usable
+// region, clear of everything memblock has reserved. Prefers a 1GB aligned
+// base so the largest alignments can be served, then falls back to
+// CMA_MIN_ALIGN.
+static bool cma_place(size_t size, uintptr_t *base) {
+    size_t aligns[] = { CMA_MAX_ALIGN, CMA_MIN_ALIGN };
+    
+    for (size_t a = 0; a < sizeof(aligns) / sizeof(aligns[0]); a++) {
+        *base = memblock_find_range(size, aligns[a], FIRST_MB_BYTES, UINT64_MAX, true);
+        if (*base) return true;
     }
+    return false;
+}
+
+// True if section sec overlaps memory the PMM may ever free
+static bool section_has_memory(struct limine_memmap_response *memmap, size_t sec) {
+    uintptr_t base = PAGES_TO_BYTES(sec << PMM_SECTION_SHIFT);
+    uintptr_t top = base + PAGES_TO_BYTES(PMM_SECTION_PAGES);
     
-    if (block->next) {
-        block->next->prev = block->prev;
+    for (size_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry *e = memmap->entries[i];
+        bool managed = e->type == LIMINE_MEMMAP_USABLE ||
+                       e->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE ||
+                       e->type == LIMINE_MEMMAP_ACPI_RECLAIMABLE;
+        if (managed && e->base < top && e->base + e->length > base) {
+            return true;
+        }
     }
+    return false;
 }
 
-// Find and remove a block from free list by page index
-static bool find_and_remove_from_free_list(size_t page_index, size_t order) {
-    void *block_virt = (void *)(page_index * PAGE_SIZE + hhdm_offset);
+// True if section sec overlaps a bootloader/ACPI reclaimable range
+static bool section_has_reclaimable(size_t sec) {
+    size_t first = sec << PMM_SECTION_SHIFT;
     
-    for (free_block_t *curr = free_lists[order]; curr != NULL; curr = curr->next) {
-        if (curr == block_virt) {
-            remove_from_free_list(curr, order);
+    for (size_t i = 0; i < reclaim_range_count; i++) {
+        if (reclaim_ranges[i].start < first + PMM_SECTION_PAGES &&
+            reclaim_ranges[i].end > first) {
             return true;
         }
     }
     return false;
 }
 
+// Pages section_online will put on the free lists
+static size_t section_usable_pages(size_t sec) {
+    size_t first = sec << PMM_SECTION_SHIFT;
+    size_t end = first + PMM_SECTION_PAGES;
+    size_t pages = 0;
+    
+    for (size_t i = 0; i < usable_range_count; i++) {
+        size_t start = usable_ranges[i].start > first ? usable_ranges[i].start : first;
+        size_t stop = usable_ranges[i].end < end ? usable_ranges[i].end : end;
+        if (start < stop) {
+            pages += count_usable_range(start, stop, boot_reserved, boot_reserved_count);
+        }
+    }
+    return pages;
+}
+
+// Set up the descriptors of section sec in packed slot and free its usable
+// memory. Caller holds pmm_lock once boot is over.
+static void section_online(size_t sec, size_t slot) {
+    pmm_zone_t *cma = &zones[ZONE_CMA];
+    size_t first = sec << PMM_SECTION_SHIFT;
+    size_t end = first + PMM_SECTION_PAGES;
+    if (end > total_pages) {
+        end = total_pages;
+    }
+    
+    struct page *pages = page_array + (slot << PMM_SECTION_SHIFT);
+    memset(pages, 0, PMM_SECTION_PAGES * sizeof(struct page));
+    sections[sec].pages = pages;
+    
+    // Zone and node are fixed per frame, the node decided once per largest
+    // buddy block
+    bool multi_node = numa_node_count() > 1;
+    uint8_t node = 0;
+    for (size_t i = first; i < end; i++) {
+        if (multi_node && i % PMM_MAX_CONTIGUOUS_PAGES == 0) {
+            node = numa_node_of_phys(PAGES_TO_BYTES(i));
+        }
+        bool in_cma = i >= cma->start_page && i < cma->end_page;
+        pages[i - first].zone = in_cma ? ZONE_CMA : page_zone_index(i);
+        pages[i - first].node = node;
+    }
+    
+    for (size_t i = 0; i < usable_range_count; i++) {
+        size_t start = usable_ranges[i].start > first ? usable_ranges[i].start : first;
+        size_t stop = usable_ranges[i].end < end ? usable_ranges[i].end : end;
+        if (start < stop) {
+            add_usable_range(start, stop, boot_reserved, boot_reserved_count);
+        }
+    }
+}
+
+// Bring deferred section sec (in packed slot) online. Caller holds pmm_lock.
+static void deferred_online(size_t sec, size_t slot) {
+    uint64_t start = rdtsc();
+    deferred_pages -= section_usable_pages(sec);
+    section_online(sec, slot);
+    zone_setup_watermarks();
+    deferred_sections--;
+    deferred_cycles += rdtsc() - start;
+    
+    if (!deferred_sections) {
+        kprintf("PMM: Deferred init done, %lu sections in %lu cycles\n",
+                deferred_total, deferred_cycles);
+    }
+}
+
+// Bring the next deferred section online. Caller holds pmm_lock. Returns
+// false once there are none left.
+static bool deferred_init_one(void) {
+    while (deferred_slot < present_sections && sections[slot_section[deferred_slot]].pages) {
+        deferred_slot++;
+    }
+    if (deferred_slot == present_sections) {
+        return false;
+    }
+    
+    deferred_online(slot_section[deferred_slot], deferred_slot);
+    return true;
+}
+
 void pmm_init(struct limine_memmap_response *memmap, struct limine_hhdm_response *hhdm) {
     if (!memmap || !hhdm) {
         kprintf("PMM Error: Received NULL responses from kmain.\n");
         return;
     }
 
+    uint64_t init_start = rdtsc();
     hhdm_offset = hhdm->offset;
 
-    // Initialize free lists
-    for (size_t i = PMM_MIN_ORDER; i <= PMM_MAX_ORDER; i++) {
-        free_lists[i] = NULL;
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    have_popcnt = ecx & CPUID_1_ECX_POPCNT;
+
+    // Initialize zones and their free lists
+    // The CMA zone stays empty until the area is placed in step 3
+    size_t zone_limits[PMM_ZONE_COUNT] = {
+        ZONE_DMA_LIMIT / PAGE_SIZE, ZONE_DMA32_LIMIT / PAGE_SIZE, SIZE_MAX, 0
+    };
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+        zones[z].start_page = (z && z != ZONE_CMA) ? zone_limits[z - 1] : 0;
+        zones[z].end_page = zone_limits[z];
+        zones[z].managed_pages = 0;
+        zones[z].free_page_count = 0;
+        memset(zones[z].free_lists, 0, sizeof(zones[z].free_lists));
+        for (size_t i = PMM_MIN_ORDER; i <= PMM_MAX_ORDER; i++) {
+            zones[z].free_block_counts[i] = 0;
+        }
     }
+    memset(nodes, 0, sizeof(nodes));
+    free_page_count = 0;
 
-    // 1. Calculate RAM size
+    // 1. Calculate RAM size. Reclaimable memory is covered by the metadata
+    // too so pmm_reclaim_boot_memory can free it later.
+    reclaim_range_count = 0;
+    usable_range_count = 0;
+    size_t usable_bytes = 0;
     for (size_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *e = memmap->entries[i];
-        if (e->type == LIMINE_MEMMAP_USABLE) {
+        bool reclaimable = e->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE ||
+                           e->type == LIMINE_MEMMAP_ACPI_RECLAIMABLE;
+        
+        if (e->type == LIMINE_MEMMAP_USABLE || reclaimable) {
             uintptr_t top = e->base + e->length;
             if (top > highest_addr) highest_addr = top;
         }
+        if (e->type == LIMINE_MEMMAP_USABLE) {
+            usable_bytes += e->length;
+            if (usable_range_count < PMM_MAX_USABLE_RANGES) {
+                usable_ranges[usable_range_count].start = e->base / PAGE_SIZE;
+                usable_ranges[usable_range_count].end = (e->base + e->length) / PAGE_SIZE;
+                usable_range_count++;
+            } else {
+                kprintf("PMM Warning: Too many usable regions, ignoring 0x%lx\n", e->base);
+            }
+        }
+        
+        if (reclaimable) {
+            if (reclaim_range_count < PMM_MAX_RECLAIM_RANGES) {
+                reclaim_ranges[reclaim_range_count].start = PAGE_ALIGN_UP(e->base) / PAGE_SIZE;
+                reclaim_ranges[reclaim_range_count].end = PAGE_ALIGN_DOWN(e->base + e->length) / PAGE_SIZE;
+                reclaim_range_count++;
+            } else {
+                kprintf("PMM Warning: Too many reclaimable regions, ignoring 0x%lx\n", e->base);
+            }
+        }
     }
+    highest_addr = PAGE_ALIGN_DOWN(highest_addr);
 
     total_pages = highest_addr / PAGE_SIZE;
-    bitmap_size = total_pages / 8;
+    // Whole 64-bit words so range operations never touch a partial word
+    bitmap_words = (total_pages + 63) / 64;
+    section_count = (total_pages + PMM_SECTION_PAGES - 1) >> PMM_SECTION_SHIFT;
 
-    // 2. Find a hole for the bitmap
-    for (size_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry *e = memmap->entries[i];
-        if (e->type == LIMINE_MEMMAP_USABLE && e->length >= bitmap_size) {
-            bitmap = (uint8_t *)(e->base + hhdm_offset);
-            memset(bitmap, 0xFF, bitmap_size);
-            break;
-        }
+    // A section gets metadata if any memory the PMM may ever free is in it
+    present_sections = 0;
+    for (size_t sec = 0; sec < section_count; sec++) {
+        if (section_has_memory(memmap, sec)) present_sections++;
     }
 
-    if (!bitmap) {
+    // 2. Each piece of metadata gets its own memblock allocation: the
+    // section table, the bitmap summaries, the bitmap words and
+    // descriptors of present sections only, and the per-CPU caches. The
+    // large ones come from the top of memory so they stay out of DMA32.
+    l1_words = (section_count * PMM_SECTION_WORDS + 63) / 64;
+    l2_words = (l1_words + 63) / 64;
+    size_t table_size = section_count * sizeof(mem_section_t) +
+                        present_sections * sizeof(uint32_t);
+    size_t summary_size = 2 * (l1_words + l2_words) * sizeof(uint64_t);
+    size_t bitmap_size = present_sections * PMM_SECTION_WORDS * sizeof(uint64_t);
+    size_t page_array_size = present_sections * PMM_SECTION_PAGES * sizeof(struct page);
+    size_t metadata_size = PAGE_ALIGN_UP(table_size) + PAGE_ALIGN_UP(summary_size) +
+                           PAGE_ALIGN_UP(bitmap_size) + PAGE_ALIGN_UP(page_array_size);
+    
+    uint64_t table_phys = memblock_alloc_high(PAGE_ALIGN_UP(table_size), PAGE_SIZE);
+    uint64_t summary_phys = memblock_alloc_high(PAGE_ALIGN_UP(summary_size), PAGE_SIZE);
+    uint64_t bitmap_phys = memblock_alloc_high(PAGE_ALIGN_UP(bitmap_size), PAGE_SIZE);
+    uint64_t page_array_phys = memblock_alloc_high(PAGE_ALIGN_UP(page_array_size), PAGE_SIZE);
+    uint64_t pcp_phys = memblock_alloc(PAGE_ALIGN_UP(MAX_CPUS * sizeof(pcp_cache_t)), PAGE_SIZE);
+
+    if (!table_phys || !summary_phys || !bitmap_phys || !page_array_phys || !pcp_phys) {
         kprintf("PMM Critical: Failed to allocate bitmap!\n");
         return;
     }
+    
+    pcp_caches = (pcp_cache_t *)(pcp_phys + hhdm_offset);
+    memset(pcp_caches, 0, MAX_CPUS * sizeof(pcp_cache_t));
 
-    // 3. Mark usable as free in bitmap
-    for (size_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry *e = memmap->entries[i];
-        if (e->type == LIMINE_MEMMAP_USABLE) {
-            for (size_t j = 0; j < e->length; j += PAGE_SIZE) {
-                bitmap_unset((e->base + j) / PAGE_SIZE);
-            }
-        }
-    }
-    //3.5 Allocate refcount array
-    size_t refcount_size = total_pages * sizeof(uint16_t);
-    for (size_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry *e = memmap->entries[i];
-        if (e->type == LIMINE_MEMMAP_USABLE && e->length >= refcount_size) {
-            page_refcounts = (uint16_t *)(e->base + hhdm_offset);
-            memset(page_refcounts, 0, refcount_size);
-            
-            // Mark refcount array as used
-            uintptr_t refcount_phys = (uintptr_t)page_refcounts - hhdm_offset;
-            size_t refcount_start_page = refcount_phys / PAGE_SIZE;
-            size_t refcount_num_pages = BYTES_TO_PAGES(refcount_size);
-            for (size_t j = 0; j < refcount_num_pages; j++) {
-                bitmap_set(refcount_start_page + j);
-            }
-            break;
+    sections = (mem_section_t *)(table_phys + hhdm_offset);
+    slot_section = (uint32_t *)(sections + section_count);
+    l1_has_free = (uint64_t *)(summary_phys + hhdm_offset);
+    l1_all_free = l1_has_free + l1_words;
+    l2_has_free = l1_all_free + l1_words;
+    l2_all_free = l2_has_free + l2_words;
+    uint64_t *bitmap = (uint64_t *)(bitmap_phys + hhdm_offset);
+    page_array = (struct page *)(page_array_phys + hhdm_offset);
+
+    // Everything starts out used, which is all-zero in the summaries.
+    // Descriptors are cleared as their section comes online.
+    memset(absent_bitmap, 0xFF, sizeof(absent_bitmap));
+    memset(bitmap, 0xFF, bitmap_size);
+    memset(l1_has_free, 0, summary_size);
+
+    // Hand out the packed slots in address order
+    size_t slot = 0;
+    for (size_t sec = 0; sec < section_count; sec++) {
+        sections[sec].pages = NULL;
+        if (section_has_memory(memmap, sec)) {
+            sections[sec].bitmap = bitmap + slot * PMM_SECTION_WORDS;
+            slot_section[slot++] = sec;
+        } else {
+            sections[sec].bitmap = absent_bitmap;
         }
     }
+    kprintf("PMM: %lu of %lu 128MB sections present, metadata %lu KB\n",
+            present_sections, section_count, metadata_size / 1024);
 
-    // 4. Mark the bitmap itself as used
-    uintptr_t bitmap_phys = (uintptr_t)bitmap - hhdm_offset;
-    size_t bitmap_start_page = bitmap_phys / PAGE_SIZE;
-    size_t bitmap_num_pages = BYTES_TO_PAGES(bitmap_size);
+    // 3. Place the contiguous memory area. Its pages still go on the free
+    // lists, but in ZONE_CMA.
+    size_t cma_size = usable_bytes / CMA_RAM_FRACTION;
+    if (cma_size > CMA_MAX_BYTES) {
+        cma_size = CMA_MAX_BYTES;
+    }
+    cma_size &= ~(CMA_MIN_ALIGN - 1);
     
-    for (size_t i = 0; i < bitmap_num_pages; i++) {
-        bitmap_set(bitmap_start_page + i);
+    uintptr_t cma_base = 0;
+    if (cma_size && cma_place(cma_size, &cma_base)) {
+        zones[ZONE_CMA].start_page = cma_base / PAGE_SIZE;
+        zones[ZONE_CMA].end_page = (cma_base + cma_size) / PAGE_SIZE;
+        kprintf("PMM: Contiguous area %lu MB at 0x%lx\n", cma_size / (1024 * 1024), cma_base);
     }
 
-    // 5. Protect the first 1MB
-    for(size_t i = 0; i < FIRST_MB_PAGES; i++) {
-        bitmap_set(i);
+    // 4. Take over memblock: whatever it handed out (the first MB, this
+    // metadata, the page tables vmm_init starts with) never goes on the
+    // free lists
+    const memblock_region_t *handover;
+    boot_reserved_count = memblock_handover(&handover);
+    for (size_t i = 0; i < boot_reserved_count; i++) {
+        boot_reserved[i].start = PAGE_ALIGN_DOWN(handover[i].base) / PAGE_SIZE;
+        boot_reserved[i].end = PAGE_ALIGN_UP(handover[i].base + handover[i].size) / PAGE_SIZE;
     }
-    // 6. Build buddy system free lists from usable regions
-    for (size_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry *e = memmap->entries[i];
-        if (e->type == LIMINE_MEMMAP_USABLE) {
-            size_t start_page = e->base / PAGE_SIZE;
-            size_t num_pages = e->length / PAGE_SIZE;
-            
-            // Add blocks of largest possible order
-            size_t page = start_page;
-            while (page < start_page + num_pages) {
-                // Skip if already marked as used (bitmap/protected)
-                if (bitmap_test(page)) {
-                    page++;
-                    continue;
-                }
-                
-                // Find largest order that fits
-                size_t order;
-                for (order = PMM_MAX_ORDER; order >= PMM_MIN_ORDER; order--) {
-                    size_t block_pages = 1 << order;
-                    
-                    // Check alignment and availability
-                    if ((page & (block_pages - 1)) == 0 && 
-                        page + block_pages <= start_page + num_pages &&
-                        is_block_free(page, order)) {
-                        add_to_free_list(page, order);
-                        page += block_pages;
-                        break;
-                    }
-                    
-                    if (order == PMM_MIN_ORDER) {
-                        page++; // Single page that couldn't be added
-                        break;
-                    }
-                }
-            }
+
+    // 5. Bring the first PMM_EARLY_INIT_BYTES of each node online now and
+    // build their free lists. Sections holding reclaimable memory come
+    // online too so pmm_reclaim_boot_memory can free into them.
+    size_t early_pages[NUMA_MAX_NODES] = {0};
+    deferred_sections = 0;
+    deferred_pages = 0;
+    deferred_slot = 0;
+    for (slot = 0; slot < present_sections; slot++) {
+        size_t sec = slot_section[slot];
+        int node = numa_node_of_phys(PAGES_TO_BYTES(sec << PMM_SECTION_SHIFT));
+        
+        if (early_pages[node] < PMM_EARLY_INIT_BYTES / PAGE_SIZE || section_has_reclaimable(sec)) {
+            section_online(sec, slot);
+            early_pages[node] += PMM_SECTION_PAGES;
+        } else {
+            deferred_sections++;
+            deferred_pages += section_usable_pages(sec);
         }
     }
+    deferred_total = deferred_sections;
+
+    zone_setup_watermarks();
 
     kprintf("PMM Ready (Buddy System). Total RAM: %d MB\n", highest_addr / (1024 * 1024));
+    if (deferred_sections) {
+        kprintf("PMM: %lu sections (%lu MB) deferred to idle time\n", deferred_sections,
+                PAGES_TO_BYTES(deferred_sections * PMM_SECTION_PAGES) / (1024 * 1024));
+    }
+    kprintf("PMM: init took %lu cycles\n", rdtsc() - init_start);
 }
 
-// Allocate a block of given order
-static void *pmm_alloc_order(size_t order) {
+// Allocate a block of given order from one node's lists in a zone, splitting
+// a larger block if needed. Returns NULL quietly if they can't satisfy it.
+static void *pmm_alloc_order(pmm_zone_t *zone, int node, size_t order) {
     if (order > PMM_MAX_ORDER) {
         kprintf("PMM Error: Requested order %d exceeds max order %d\n", 
                 order, PMM_MAX_ORDER);
         return NULL;
     }
 
-    // Check if we have a free block at this order
-    if (free_lists[order]) {
-        free_block_t *block = free_lists[order];
-        size_t page_index = ((uintptr_t)block - hhdm_offset) / PAGE_SIZE;
-        
-        remove_from_free_list(block, order);
-        mark_block_used(page_index, order);
-        
-        return (void *)(page_index * PAGE_SIZE);
+    // Find the smallest order with a free block
+    size_t current = order;
+    while (current <= PMM_MAX_ORDER && !zone->free_lists[node][current]) {
+        current++;
+    }
+    if (current > PMM_MAX_ORDER) {
+        return NULL;
     }
 
-    // No block available, split a larger block
-    if (order < PMM_MAX_ORDER) {
-        void *larger_block = pmm_alloc_order(order + 1);
-        if (!larger_block) {
-            kprintf("PMM Warning: Failed to allocate block of order %d (out of memory)\n", order);
-            return NULL;
-        }
+    struct page *block = zone->free_lists[node][current];
+    size_t page_index = page_to_index(block);
+    remove_from_free_list(block, current);
 
-        size_t page_index = (uintptr_t)larger_block / PAGE_SIZE;
-        
-        // Split: mark first half as used, add second half to free list
-        size_t buddy_index = page_index + (1 << order);
-        mark_block_free(buddy_index, order);
-        add_to_free_list(buddy_index, order);
-        
-        return larger_block;
+    // Split: keep the first half, put the second half on the free list
+    while (current > order) {
+        current--;
+        add_to_free_list(page_index + (1UL << current), current);
+    }
+    
+    mark_block_used(page_index, order);
+    return (void *)(page_index * PAGE_SIZE);
+}
+
+// Allocate from one zone, trying node first and then the other nodes in
+// order of distance
+static void *pmm_alloc_zone_near(pmm_zone_t *zone, int node, size_t order) {
+    const uint8_t *near = numa_node_order(node);
+    
+    for (size_t i = 0; i < numa_node_count(); i++) {
+        void *page = pmm_alloc_order(zone, near[i], order);
+        if (page) {
+            if (i == 0) {
+                nodes[node].local_allocs++;
+            } else {
+                nodes[node].remote_allocs++;
+            }
+            return page;
+        }
     }
-
-    kprintf("PMM Error: Out of memory at max order %d\n", PMM_MAX_ORDER);
     return NULL;
 }
 
+// Allocate from zone_index, falling back to lower zones. Within a zone the
+// nearest node wins, so a remote node's memory is used before a lower zone.
+// A fallback zone is only used while it stays above its low watermark, so
+// scarce low memory is kept for callers that actually need it. Ordinary
+// allocations borrow the contiguous area last, once everything else is
+// exhausted.
+static void *pmm_alloc_zones_node(int zone_index, int node, size_t order) {
+    for (int z = zone_index; z >= 0; z--) {
+        pmm_zone_t *zone = &zones[z];
+        
+        if (z != zone_index &&
+            zone->free_page_count < zone->watermark_low + (1UL << order)) {
+            continue;
+        }
+        
+        void *page = pmm_alloc_zone_near(zone, node, order);
+        if (page) {
+            return page;
+        }
+    }
+    
+    if (zone_index == default_zone) {
+        return pmm_alloc_zone_near(&zones[ZONE_CMA], node, order);
+    }
+    return NULL;
+}
+
+// Same, preferring the executing CPU's node
+static void *pmm_alloc_zones(int zone_index, size_t order) {
+    return pmm_alloc_zones_node(zone_index, numa_local_node(), order);
+}
+
 // Free a block and try to coalesce with buddy
 static void pmm_free_order(void *page, size_t order) {
     if (!page) {
@@ -289,7 +1073,7 @@ static void pmm_free_order(void *page, size_t order) {
     uintptr_t phys = (uintptr_t)page;
     size_t page_index = phys / PAGE_SIZE;
     
-    if (page_index >= total_pages) {
+    if (!pfn_valid(page_index)) {
         kprintf("PMM Error: Invalid page index %d (max %d)\n", page_index, total_pages);
         return;
     }
@@ -299,28 +1083,32 @@ static void pmm_free_order(void *page, size_t order) {
         return;
     }
     
+    struct page *head = index_to_page(page_index);
+    if (head->flags & (PAGE_FLAG_FREE | PAGE_FLAG_PCP)) {
+        kprintf("PMM Error: Double free detected at 0x%lx\n", phys);
+        return;
+    }
+    
+    // Drop any owner state left by the previous user
+    head->flags = 0;
+    head->private = NULL;
+    head->refcount = 0;
+    
     // Mark as free in bitmap
     mark_block_free(page_index, order);
 
-    // Try to coalesce with buddy
+    // Try to coalesce with buddy. The buddy can only be merged if it heads
+    // a free block of the same order, which its descriptor tells us without
+    // touching the bitmap or walking the free list.
     while (order < PMM_MAX_ORDER) {
         size_t buddy_index = get_buddy_index(page_index, order);
-        size_t block_size = 1 << (order + 1);
-        size_t aligned_start = page_index & ~(block_size - 1);
-        if (aligned_start != page_index && aligned_start != buddy_index) {
-        // Parent block wouldn't be properly aligned
-            break;
-        }
-        // Check if buddy is free and exists
-        if (buddy_index >= total_pages || !is_block_free(buddy_index, order)) {
-            break;
-        }
         
-        // Check if buddy is in the free list
-        if (!find_and_remove_from_free_list(buddy_index, order)) {
+        if (buddy_index >= total_pages || !is_free_head(buddy_index, order)) {
             break;
         }
         
+        remove_from_free_list(index_to_page(buddy_index), order);
+        
         // Coalesce: use lower address as parent
         if (buddy_index < page_index) {
             page_index = buddy_index;
@@ -350,79 +1138,932 @@ static size_t pages_to_order(size_t pages) {
     return order;
 }
 
+// Zero a page with non-temporal stores so filling the pool doesn't evict
+// whatever the rest of the kernel has in cache
+static void zero_page_nt(void *virt) {
+    uint64_t *p = (uint64_t *)virt;
+    uint64_t *end = p + PAGE_SIZE / sizeof(uint64_t);
+    
+    for (; p < end; p += 4) {
+        asm volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)"
+            :: "r"(p), "r"(0UL) : "memory");
+    }
+}
+
+static void *zero_pool_pop(void) {
+    void *page = NULL;
+    
+    uint64_t flags = irq_save();
+    spin_lock(&zero_pool_lock);
+    if (zero_pool_count) {
+        page = (void *)zero_pool[--zero_pool_count];
+    }
+    spin_unlock(&zero_pool_lock);
+    irq_restore(flags);
+    
+    return page;
+}
+
+// Zero up to ZERO_POOL_BATCH fresh frames into the pool. Returns true if the
+// pool still wants more.
+static bool zero_pool_fill(void) {
+    uintptr_t batch[ZERO_POOL_BATCH];
+    size_t count = 0;
+    size_t want = ZERO_POOL_SIZE - zero_pool_count;
+    if (want > ZERO_POOL_BATCH) {
+        want = ZERO_POOL_BATCH;
+    }
+    
+    // Only ever take local frames from the default zone, and only while it
+    // is comfortably above its high watermark
+    pmm_zone_t *zone = &zones[default_zone];
+    int node = numa_local_node();
+    
+    pmm_lock_acquire();
+    while (count < want && free_page_count > ZERO_POOL_MIN_FREE &&
+           zone->free_page_count > zone->watermark_high) {
+        void *page = pmm_alloc_order(zone, node, PMM_MIN_ORDER);
+        if (!page) break;
+        batch[count++] = (uintptr_t)page;
+    }
+    pmm_lock_release();
+    
+    if (count == 0) {
+        return false;
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        zero_page_nt((void *)(batch[i] + hhdm_offset));
+    }
+    asm volatile("sfence" ::: "memory");
+    
+    uint64_t flags = irq_save();
+    spin_lock(&zero_pool_lock);
+    for (size_t i = 0; i < count; i++) {
+        zero_pool[zero_pool_count++] = batch[i];
+    }
+    bool more = zero_pool_count < ZERO_POOL_SIZE;
+    spin_unlock(&zero_pool_lock);
+    irq_restore(flags);
+    
+    return more;
+}
+
+// Background PMM work for the idle loop. Returns true while there is more
+// to do, false when the caller can halt until the next interrupt.
+bool pmm_idle_work(void) {
+    if (!sections) {
+        return false;
+    }
+    
+    // One deferred section per step keeps the idle loop responsive
+    if (deferred_sections) {
+        pmm_lock_acquire();
+        deferred_init_one();
+        pmm_lock_release();
+        return true;
+    }
+    
+    if (zero_pool_fill()) {
+        return true;
+    }
+    
+    // Keep 2MB blocks available. A failed pass is not retried until the
+    // free page count changes.
+    bool more = false;
+    pmm_lock_acquire();
+    if (free_page_count != compact_idle_skip &&
+        fragmentation_index(COMPACT_IDLE_ORDER) >= COMPACT_IDLE_THRESHOLD) {
+        more = compact_zones(default_zone, COMPACT_IDLE_ORDER);
+        if (!more) {
+            compact_idle_skip = free_page_count;
+        }
+    }
+    pmm_lock_release();
+    
+    return more;
+}
+
+// Fill out[] with up to count single frames, carving them out of the largest
+// blocks that fit the remaining count. Every frame can later be freed on its
+// own. Caller holds pmm_lock. Returns how many frames were allocated.
+static size_t alloc_bulk_locked(int zone_index, size_t count, uintptr_t *out) {
+    size_t done = 0;
+    size_t order = PMM_MAX_ORDER;
+    
+    while (done < count) {
+        while ((1UL << order) > count - done) {
+            order--;
+        }
+        
+        void *block = pmm_alloc_zones(zone_index, order);
+        if (!block) {
+            if (order > PMM_MIN_ORDER) {
+                order--;
+            } else if (deferred_init_one()) {
+                order = PMM_MAX_ORDER;
+            } else {
+                break;
+            }
+            continue;
+        }
+        
+        for (size_t i = 0; i < (1UL << order); i++) {
+            out[done++] = (uintptr_t)block + PAGES_TO_BYTES(i);
+        }
+    }
+    
+    return done;
+}
+
+// Refill the cold list with a batch of order-0 frames (pmm_lock taken once)
+static void pcp_refill(pcp_cache_t *pcp) {
+    pmm_lock_acquire();
+    size_t got = alloc_bulk_locked(default_zone, PCP_BATCH - pcp->cold_count,
+                                   pcp->cold + pcp->cold_count);
+    pmm_lock_release();
+    
+    for (size_t i = 0; i < got; i++) {
+        index_to_page(pcp->cold[pcp->cold_count++] / PAGE_SIZE)->flags |= PAGE_FLAG_PCP;
+    }
+    pcp->refills++;
+}
+
+// Take a frame out of a per-CPU cache
+static void *pcp_take(uintptr_t phys) {
+    index_to_page(phys / PAGE_SIZE)->flags &= ~PAGE_FLAG_PCP;
+    return (void *)phys;
+}
+
+// Return up to count frames to the buddy system, cold ones first, then the
+// oldest hot ones (pmm_lock taken once)
+static void pcp_drain(pcp_cache_t *pcp, size_t count) {
+    pmm_lock_acquire();
+    while (count && pcp->cold_count) {
+        pmm_free_order(pcp_take(pcp->cold[--pcp->cold_count]), PMM_MIN_ORDER);
+        count--;
+    }
+    
+    size_t drained = count < pcp->hot_count ? count : pcp->hot_count;
+    for (size_t i = 0; i < drained; i++) {
+        pmm_free_order(pcp_take(pcp->hot[i]), PMM_MIN_ORDER);
+    }
+    pmm_lock_release();
+    
+    pcp->hot_count -= drained;
+    memmove(pcp->hot, pcp->hot + drained, pcp->hot_count * sizeof(uintptr_t));
+    pcp->drains++;
+}
+
+static size_t pcp_cached_pages(void) {
+    size_t pages = 0;
+    for (size_t cpu = 0; pcp_caches && cpu < MAX_CPUS; cpu++) {
+        pages += pcp_caches[cpu].hot_count + pcp_caches[cpu].cold_count;
+    }
+    return pages;
+}
+
+// Hand every frame cached by this CPU back to the buddy system so it can
+// coalesce (used before failing a multi-page allocation)
+void pmm_drain_local_cache(void) {
+    uint64_t flags = irq_save();
+    pcp_cache_t *pcp = &pcp_caches[cpu_id()];
+    if (pcp->hot_count || pcp->cold_count) {
+        pcp_drain(pcp, pcp->hot_count + pcp->cold_count);
+    }
+    irq_restore(flags);
+}
+
 // Public API
 void *pmm_alloc_page(void) {
-    spin_lock(&pmm_lock);
-    void *page = pmm_alloc_order(PMM_MIN_ORDER);
-    spin_unlock(&pmm_lock);
+    uint64_t flags = irq_save();
+    pcp_cache_t *pcp = &pcp_caches[cpu_id()];
+    
+    if (pcp->hot_count + pcp->cold_count <= PCP_LOW) {
+        pcp_refill(pcp);
+    } else {
+        pcp->hits++;
+    }
+    
+    void *page = NULL;
+    if (pcp->hot_count) {
+        page = pcp_take(pcp->hot[--pcp->hot_count]);
+    } else if (pcp->cold_count) {
+        page = pcp_take(pcp->cold[--pcp->cold_count]);
+    }
+    irq_restore(flags);
+    
+    // Last resort: a pre-zeroed frame is still a free frame
+    if (!page) {
+        page = zero_pool_pop();
+    }
     
     if (!page) {
         kprintf("PMM Critical: Failed to allocate single page (system out of memory)\n");
     }
     
-    return page;
+    return page;
+}
+
+void pmm_free_page(void *page) {
+    if (!page) {
+        kprintf("PMM Warning: pmm_free_page called with NULL pointer\n");
+        return;
+    }
+    
+    uintptr_t phys = (uintptr_t)page;
+    size_t page_index = phys / PAGE_SIZE;
+    
+    if (!pfn_valid(page_index) || page_index < FIRST_MB_PAGES) {
+        kprintf("PMM Error: Invalid free attempt at 0x%lx (index %d)\n", phys, page_index);
+        return;
+    }
+    
+    struct page *desc = index_to_page(page_index);
+    if (desc->flags & (PAGE_FLAG_FREE | PAGE_FLAG_PCP)) {
+        kprintf("PMM Error: Double free detected at 0x%lx\n", phys);
+        return;
+    }
+    
+    // Frames from lower zones, the contiguous area and other nodes go
+    // straight back so they don't get handed out to ordinary (local)
+    // allocations through the cache
+    if (desc->zone < default_zone || desc->zone == ZONE_CMA ||
+        desc->node != numa_local_node()) {
+        pmm_lock_acquire();
+        pmm_free_order(page, PMM_MIN_ORDER);
+        pmm_lock_release();
+        return;
+    }
+    
+    // Cached frames skip pmm_free_order, so drop owner state here
+    desc->flags = PAGE_FLAG_PCP;
+    desc->private = NULL;
+    
+    uint64_t flags = irq_save();
+    pcp_cache_t *pcp = &pcp_caches[cpu_id()];
+    
+    pcp->hot[pcp->hot_count++] = phys;
+    if (pcp->hot_count >= PCP_HIGH) {
+        pcp_drain(pcp, PCP_BATCH);
+    }
+    irq_restore(flags);
+}
+
+// Free the page range [page_index, page_index + count) as naturally aligned
+// buddy blocks, letting each one coalesce normally. Caller holds pmm_lock.
+static void free_page_range(size_t page_index, size_t count) {
+    size_t end = page_index + count;
+    
+    while (page_index < end) {
+        size_t order = page_index ? (size_t)__builtin_ctzl(page_index) : PMM_MAX_ORDER;
+        if (order > PMM_MAX_ORDER) {
+            order = PMM_MAX_ORDER;
+        }
+        while ((1UL << order) > end - page_index) {
+            order--;
+        }
+        pmm_free_order((void *)(page_index * PAGE_SIZE), order);
+        page_index += 1UL << order;
+    }
+}
+
+// Allocate a block of the given order from zone_index (or a lower zone),
+// nearest to node, and give everything past the first keep pages straight
+// back to the buddy system
+static void *alloc_block(int zone_index, int node, size_t order, size_t keep) {
+    pmm_lock_acquire();
+    void *page = pmm_alloc_zones_node(zone_index, node, order);
+    pmm_lock_release();
+    
+    // Frames parked in the per-CPU cache may be what blocks coalescing
+    if (!page) {
+        pmm_drain_local_cache();
+        pmm_lock_acquire();
+        page = pmm_alloc_zones_node(zone_index, node, order);
+        pmm_lock_release();
+    }
+    
+    // Memory that isn't online yet is cheaper than reclaim
+    if (!page) {
+        pmm_lock_acquire();
+        while (!page && deferred_init_one()) {
+            page = pmm_alloc_zones_node(zone_index, node, order);
+        }
+        pmm_lock_release();
+    }
+    
+    // Still nothing: have caches give back empty slabs, then migrate movable
+    // pages to rebuild a block of this order
+    if (!page && order >= COMPACT_MIN_ORDER) {
+        run_shrinkers();
+        pmm_lock_acquire();
+        page = pmm_alloc_zones_node(zone_index, node, order);
+        if (!page && compact_zones(zone_index, order)) {
+            page = pmm_alloc_zones_node(zone_index, node, order);
+        }
+        pmm_lock_release();
+    }
+    
+    if (page && keep < (1UL << order)) {
+        pmm_lock_acquire();
+        free_page_range((uintptr_t)page / PAGE_SIZE + keep, (1UL << order) - keep);
+        exact_pages_saved += (1UL << order) - keep;
+        pmm_lock_release();
+    }
+    
+    return page;
+}
+
+void *pmm_alloc_pages(size_t count) {
+    if (count == 0) {
+        kprintf("PMM Warning: pmm_alloc_pages called with count=0\n");
+        return NULL;
+    }
+    
+    // Beyond the largest buddy block, go through the contiguous allocator
+    if (count > PMM_MAX_CONTIGUOUS_PAGES) {
+        return pmm_alloc_contig(count, PAGE_SIZE);
+    }
+    
+    size_t order = pages_to_order(count);
+    void *page = alloc_block(default_zone, numa_local_node(), order, 1UL << order);
+    
+    if (!page) {
+        kprintf("PMM Critical: Failed to allocate %d pages (order %d)\n", count, order);
+    }
+    
+    return page;
+}
+
+void *pmm_alloc_pages_node(size_t count, int node) {
+    if (count == 0) {
+        kprintf("PMM Warning: pmm_alloc_pages_node called with count=0\n");
+        return NULL;
+    }
+    
+    if (node < 0 || (size_t)node >= numa_node_count()) {
+        kprintf("PMM Error: Invalid NUMA node %d\n", node);
+        return NULL;
+    }
+    
+    if (count > PMM_MAX_CONTIGUOUS_PAGES) {
+        kprintf("PMM Error: Requested %d pages exceeds max contiguous allocation (%d pages)\n",
+                count, PMM_MAX_CONTIGUOUS_PAGES);
+        return NULL;
+    }
+    
+    size_t order = pages_to_order(count);
+    void *page = alloc_block(default_zone, node, order, 1UL << order);
+    
+    if (!page) {
+        kprintf("PMM Critical: Failed to allocate %d pages near node %d\n", count, node);
+    }
+    
+    return page;
+}
+
+void pmm_free_pages(void *pages, size_t count) {
+    if (!pages) {
+        kprintf("PMM Warning: pmm_free_pages called with NULL pointer\n");
+        return;
+    }
+    
+    if (count == 0) {
+        kprintf("PMM Warning: pmm_free_pages called with count=0\n");
+        return;
+    }
+    
+    if (count > PMM_MAX_CONTIGUOUS_PAGES) {
+        pmm_free_contig(pages, count);
+        return;
+    }
+    
+    pmm_lock_acquire();
+    size_t order = pages_to_order(count);
+    pmm_free_order(pages, order);
+    pmm_lock_release();
+}
+
+void *pmm_alloc_pages_exact(size_t count) {
+    if (count == 0) {
+        kprintf("PMM Warning: pmm_alloc_pages_exact called with count=0\n");
+        return NULL;
+    }
+    
+    if (count > PMM_MAX_CONTIGUOUS_PAGES) {
+        return pmm_alloc_contig(count, PAGE_SIZE);
+    }
+    
+    void *page = alloc_block(default_zone, numa_local_node(), pages_to_order(count), count);
+    
+    if (!page) {
+        kprintf("PMM Critical: Failed to allocate exactly %d pages\n", count);
+    }
+    
+    return page;
+}
+
+void pmm_free_pages_exact(void *pages, size_t count) {
+    if (!pages) {
+        kprintf("PMM Warning: pmm_free_pages_exact called with NULL pointer\n");
+        return;
+    }
+    
+    if (count == 0) {
+        kprintf("PMM Warning: pmm_free_pages_exact called with count=0\n");
+        return;
+    }
+    
+    pmm_lock_acquire();
+    free_page_range((uintptr_t)pages / PAGE_SIZE, count);
+    pmm_lock_release();
+}
+
+size_t pmm_alloc_pages_bulk(size_t count, void **out) {
+    if (!out || count == 0) {
+        kprintf("PMM Warning: pmm_alloc_pages_bulk called with count=0 or NULL array\n");
+        return 0;
+    }
+    
+    pmm_lock_acquire();
+    size_t done = alloc_bulk_locked(default_zone, count, (uintptr_t *)out);
+    pmm_lock_release();
+    
+    if (done < count) {
+        kprintf("PMM Warning: Bulk allocation satisfied %lu of %lu pages\n", done, count);
+    }
+    
+    return done;
+}
+
+void pmm_free_pages_bulk(size_t count, void **pages) {
+    if (!pages) {
+        kprintf("PMM Warning: pmm_free_pages_bulk called with NULL array\n");
+        return;
+    }
+    
+    pmm_lock_acquire();
+    for (size_t i = 0; i < count; i++) {
+        if (pages[i]) {
+            pmm_free_order(pages[i], PMM_MIN_ORDER);
+        }
+    }
+    pmm_lock_release();
+}
+
+void *pmm_alloc_pages_zone(size_t count, int zone) {
+    if (count == 0) {
+        kprintf("PMM Warning: pmm_alloc_pages_zone called with count=0\n");
+        return NULL;
+    }
+    
+    if (zone < 0 || zone >= PMM_ZONE_COUNT) {
+        kprintf("PMM Error: Invalid zone %d\n", zone);
+        return NULL;
+    }
+    
+    if (count > PMM_MAX_CONTIGUOUS_PAGES) {
+        kprintf("PMM Error: Requested %d pages exceeds max contiguous allocation (%d pages)\n",
+                count, PMM_MAX_CONTIGUOUS_PAGES);
+        return NULL;
+    }
+    
+    size_t order = pages_to_order(count);
+    void *page = alloc_block(zone, numa_local_node(), order, 1UL << order);
+    
+    if (!page) {
+        kprintf("PMM Critical: Failed to allocate %d pages in zone %s or below\n",
+                count, zones[zone].name);
+    }
+    
+    return page;
+}
+
+// Take [start, start + count) off the free lists. Every page in the range
+// must be free. Blocks sticking out at either end are split and the parts
+// outside the range go back on the free lists. Called with pmm_lock held.
+static bool claim_range(size_t start, size_t count) {
+    size_t end = start + count;
+    size_t pos = start;
+    
+    while (pos < end) {
+        // The free block holding pos is naturally aligned, so its head is
+        // pos rounded down to the block size
+        size_t order = PMM_MIN_ORDER;
+        size_t head = pos;
+        while (order <= PMM_MAX_ORDER && !is_free_head(head, order)) {
+            order++;
+            head = pos & ~((1UL << order) - 1);
+        }
+        
+        if (order > PMM_MAX_ORDER) {
+            kprintf("PMM Critical: Page %lu is free in the bitmap but on no free list\n", pos);
+            bitmap_set_range(start, pos - start);
+            free_page_range(start, pos - start);
+            return false;
+        }
+        
+        size_t block_end = head + (1UL << order);
+        remove_from_free_list(index_to_page(head), order);
+        add_free_range(head, pos);
+        if (block_end > end) {
+            add_free_range(end, block_end);
+            block_end = end;
+        }
+        pos = block_end;
+    }
+    
+    bitmap_set_range(start, count);
+    return true;
+}
+
+// Check whether [start, start + count) can be emptied by migration: every
+// used page in it must be movable. Counts them into *movable.
+static bool window_movable(size_t start, size_t count, size_t *movable) {
+    size_t end = start + count;
+    size_t moves = 0;
+    
+    for (size_t pos = next_used(start, end); pos < end; pos = next_used(pos + 1, end)) {
+        // Holes between sections read as used and have no descriptor
+        if (!pfn_valid(pos) || !(index_to_page(pos)->flags & PAGE_FLAG_MOVABLE)) {
+            return false;
+        }
+        moves++;
+    }
+    
+    *movable = moves;
+    return true;
+}
+
+// Find the count-page window in zone_index, aligned to align pages, that
+// needs the fewest migrations to empty. Large windows are tried at block
+// boundaries only, which keeps the scan linear. Returns SIZE_MAX if every
+// window holds an unmovable page.
+static size_t find_movable_window(int zone_index, size_t count, size_t align) {
+    pmm_zone_t *zone = &zones[zone_index];
+    size_t start = zone->start_page > FIRST_MB_PAGES ? zone->start_page : FIRST_MB_PAGES;
+    size_t end = zone->end_page < total_pages ? zone->end_page : total_pages;
+    size_t stride = align;
+    size_t best = SIZE_MAX;
+    size_t best_moves = SIZE_MAX;
+    
+    if (count > stride && stride < PMM_MAX_CONTIGUOUS_PAGES) {
+        stride = PMM_MAX_CONTIGUOUS_PAGES;
+    }
+    
+    for (size_t pos = (start + stride - 1) & ~(stride - 1); pos + count <= end; pos += stride) {
+        size_t moves;
+        
+        // Zones can share an address range (the CMA sits inside another)
+        if (!pfn_valid(pos) || !pfn_valid(pos + count - 1) ||
+            index_to_page(pos)->zone != zone_index ||
+            index_to_page(pos + count - 1)->zone != zone_index) {
+            continue;
+        }
+        if (window_movable(pos, count, &moves) && moves < best_moves) {
+            best = pos;
+            best_moves = moves;
+            if (moves == 0) break;
+        }
+    }
+    
+    return best;
+}
+
+// Give back the pages of a window whose migration was abandoned: everything
+// except the movable pages still living there. Caller holds pmm_lock.
+static void release_window(size_t start, size_t count) {
+    size_t end = start + count;
+    size_t pos = start;
+    
+    while (pos < end) {
+        while (pos < end && (index_to_page(pos)->flags & PAGE_FLAG_MOVABLE)) {
+            pos++;
+        }
+        size_t run = pos;
+        while (pos < end && !(index_to_page(pos)->flags & PAGE_FLAG_MOVABLE)) {
+            pos++;
+        }
+        if (pos > run) {
+            free_page_range(run, pos - run);
+        }
+    }
+}
+
+// Empty a window found by find_movable_window and leave all of it allocated.
+// Free runs inside are claimed first so no copy lands in the window. Each
+// movable page is copied through the HHDM to a new frame, its one mapping
+// is pointed at the copy and the descriptor moves along with it. With one
+// CPU and pmm_lock held nothing can write the page mid-copy. Caller holds
+// pmm_lock.
+static bool migrate_window(size_t start, size_t count) {
+    size_t end = start + count;
+    size_t pos = start;
+    
+    while ((pos = next_free(pos, end)) < end) {
+        size_t run_end = next_used(pos, end);
+        if (!claim_range(pos, run_end - pos)) {
+            release_window(start, pos - start);
+            return false;
+        }
+        pos = run_end;
+    }
+    
+    for (pos = start; pos < end; pos++) {
+        struct page *from = index_to_page(pos);
+        if (!(from->flags & PAGE_FLAG_MOVABLE)) {
+            continue;
+        }
+        
+        void *target = pmm_alloc_zones(default_zone, PMM_MIN_ORDER);
+        if (!target) {
+            release_window(start, count);
+            return false;
+        }
+        
+        uintptr_t old_phys = pos * PAGE_SIZE;
+        uintptr_t new_phys = (uintptr_t)target;
+        memcpy((void *)(new_phys + hhdm_offset), (void *)(old_phys + hhdm_offset), PAGE_SIZE);
+        
+        if (!vmm_remap_page(from->pml4, from->virt, old_phys, new_phys)) {
+            kprintf("PMM Warning: Movable page 0x%lx is not mapped at 0x%lx, not migrating\n",
+                    old_phys, from->virt);
+            pmm_free_order(target, PMM_MIN_ORDER);
+            release_window(start, count);
+            return false;
+        }
+        
+        struct page *to = index_to_page(new_phys / PAGE_SIZE);
+        to->pml4 = from->pml4;
+        to->virt = from->virt;
+        to->private = from->private;
+        to->refcount = from->refcount;
+        to->flags = from->flags;
+        
+        from->flags = 0;
+        from->private = NULL;
+        from->refcount = 0;
+        pages_migrated++;
+    }
+    
+    return true;
+}
+
+// Build one free block of the given order in zone_index by migration.
+// Caller holds pmm_lock.
+static bool compact_zone(int zone_index, size_t order) {
+    size_t count = 1UL << order;
+    
+    compact_runs++;
+    size_t start = find_movable_window(zone_index, count, count);
+    if (start == SIZE_MAX || !migrate_window(start, count)) {
+        return false;
+    }
+    
+    free_page_range(start, count);
+    compact_successes++;
+    return true;
+}
+
+// Compact zone_index, then the zones an allocation from it may fall back
+// to, in the same order pmm_alloc_zones tries them. Caller holds pmm_lock.
+static bool compact_zones(int zone_index, size_t order) {
+    for (int z = zone_index; z >= 0; z--) {
+        if (zones[z].managed_pages && compact_zone(z, order)) {
+            return true;
+        }
+    }
+    
+    if (zone_index == default_zone && zones[ZONE_CMA].managed_pages) {
+        return compact_zone(ZONE_CMA, order);
+    }
+    return false;
+}
+
+// Ask every registered cache to give back its unused pages. Called without
+// pmm_lock, since shrinkers free through the normal paths.
+static void run_shrinkers(void) {
+    size_t freed = 0;
+    
+    for (size_t i = 0; i < shrinker_count; i++) {
+        freed += shrinkers[i]();
+    }
+    
+    // Single frames come back through the per-CPU cache
+    if (freed) {
+        pmm_drain_local_cache();
+    }
+}
+
+void pmm_register_shrinker(pmm_shrinker_t shrink) {
+    if (!shrink) {
+        kprintf("PMM Warning: pmm_register_shrinker called with NULL callback\n");
+        return;
+    }
+    
+    if (shrinker_count >= PMM_MAX_SHRINKERS) {
+        kprintf("PMM Error: No room for another shrinker (max %d)\n", PMM_MAX_SHRINKERS);
+        return;
+    }
+    
+    shrinkers[shrinker_count++] = shrink;
+}
+
+bool pmm_compact(size_t order) {
+    if (order > PMM_MAX_ORDER) {
+        kprintf("PMM Error: Cannot compact for order %d (max %d)\n", order, PMM_MAX_ORDER);
+        return false;
+    }
+    
+    run_shrinkers();
+    pmm_drain_local_cache();
+    
+    pmm_lock_acquire();
+    bool ok = compact_zones(default_zone, order);
+    pmm_lock_release();
+    
+    return ok;
+}
+
+void *pmm_alloc_page_movable(uint64_t *pml4, uint64_t virt) {
+    if (!pml4) {
+        kprintf("PMM Error: pmm_alloc_page_movable called with NULL pml4\n");
+        return NULL;
+    }
+    
+    // Movable pages go to the CMA first: they are the ones that can be
+    // moved out again when a contiguous allocation needs the space
+    pmm_lock_acquire();
+    void *page = pmm_alloc_zone_near(&zones[ZONE_CMA], numa_local_node(), PMM_MIN_ORDER);
+    if (!page) {
+        page = pmm_alloc_zones(default_zone, PMM_MIN_ORDER);
+    }
+    while (!page && deferred_init_one()) {
+        page = pmm_alloc_zones(default_zone, PMM_MIN_ORDER);
+    }
+    if (page) {
+        struct page *desc = index_to_page((uintptr_t)page / PAGE_SIZE);
+        desc->flags = PAGE_FLAG_MOVABLE;
+        desc->pml4 = pml4;
+        desc->virt = virt;
+    }
+    pmm_lock_release();
+    
+    if (!page) {
+        kprintf("PMM Critical: Failed to allocate movable page\n");
+    }
+    return page;
+}
+
+// Linux-style fragmentation index over all zones. Caller holds pmm_lock.
+static int fragmentation_index(size_t order) {
+    size_t blocks = 0;
+    
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+        for (size_t i = PMM_MIN_ORDER; i <= PMM_MAX_ORDER; i++) {
+            if (i >= order && zones[z].free_block_counts[i]) {
+                return -1;
+            }
+            blocks += zones[z].free_block_counts[i];
+        }
+    }
+    
+    if (!blocks) {
+        return 0;
+    }
+    
+    // A handful of blocks holding less than one request is a shortage
+    int index = 1000 - (int)((1000 + free_page_count * 1000 / (1UL << order)) / blocks);
+    return index > 0 ? index : 0;
 }
 
-void pmm_free_page(void *page) {
-    if (!page) {
-        kprintf("PMM Warning: pmm_free_page called with NULL pointer\n");
-        return;
-    }
-    
-    spin_lock(&pmm_lock);
-    
-    uintptr_t phys = (uintptr_t)page;
-    size_t page_index = phys / PAGE_SIZE;
-    
-    if (page_index >= total_pages || page_index < FIRST_MB_PAGES) {
-        kprintf("PMM Error: Invalid free attempt at 0x%lx (index %d)\n", phys, page_index);
-        spin_unlock(&pmm_lock);
-        return;
+int pmm_fragmentation_index(size_t order) {
+    if (order > PMM_MAX_ORDER) {
+        kprintf("PMM Error: Invalid order %d for fragmentation index\n", order);
+        return 0;
     }
     
-    pmm_free_order(page, PMM_MIN_ORDER);
-    spin_unlock(&pmm_lock);
+    pmm_lock_acquire();
+    int index = fragmentation_index(order);
+    pmm_lock_release();
+    return index;
 }
 
-void *pmm_alloc_pages(size_t count) {
+void *pmm_alloc_contig(size_t count, size_t align) {
     if (count == 0) {
-        kprintf("PMM Warning: pmm_alloc_pages called with count=0\n");
+        kprintf("PMM Warning: pmm_alloc_contig called with count=0\n");
         return NULL;
     }
     
-    if (count > PMM_MAX_CONTIGUOUS_PAGES) {
-        kprintf("PMM Error: Requested %d pages exceeds max contiguous allocation (%d pages)\n",
-                count, PMM_MAX_CONTIGUOUS_PAGES);
+    if (align & (align - 1) || align > CMA_MAX_ALIGN) {
+        kprintf("PMM Error: Invalid contiguous alignment 0x%lx\n", align);
         return NULL;
     }
     
-    spin_lock(&pmm_lock);
-    size_t order = pages_to_order(count);
-    void *page = pmm_alloc_order(order);
-    spin_unlock(&pmm_lock);
+    size_t align_pages = align > PAGE_SIZE ? align / PAGE_SIZE : 1;
+    pmm_zone_t *cma = &zones[ZONE_CMA];
+    size_t start = SIZE_MAX;
     
-    if (!page) {
-        kprintf("PMM Critical: Failed to allocate %d pages (order %d)\n", count, order);
+    // Cached frames could be sitting in the middle of a suitable range
+    pmm_drain_local_cache();
+    
+    pmm_lock_acquire();
+    // Every section that comes online may complete a run
+    do {
+        if (cma->managed_pages) {
+            start = bitmap_find_free_run(cma->start_page, cma->end_page, count, align_pages);
+        }
+        if (start == SIZE_MAX) {
+            start = bitmap_find_free_run(FIRST_MB_PAGES, total_pages, count, align_pages);
+        }
+        if (start != SIZE_MAX && !claim_range(start, count)) {
+            start = SIZE_MAX;
+        }
+    } while (start == SIZE_MAX && deferred_init_one());
+    // Movable pages borrowed from the CMA can be migrated out of the way
+    if (start == SIZE_MAX && cma->managed_pages) {
+        start = find_movable_window(ZONE_CMA, count, align_pages);
+        if (start != SIZE_MAX && !migrate_window(start, count)) {
+            start = SIZE_MAX;
+        }
     }
+    pmm_lock_release();
     
-    return page;
+    if (start == SIZE_MAX) {
+        kprintf("PMM Critical: Failed to allocate %lu contiguous pages aligned to 0x%lx\n",
+                count, align);
+        return NULL;
+    }
+    
+    return (void *)(start * PAGE_SIZE);
 }
 
-void pmm_free_pages(void *pages, size_t count) {
+void pmm_free_contig(void *pages, size_t count) {
     if (!pages) {
-        kprintf("PMM Warning: pmm_free_pages called with NULL pointer\n");
+        kprintf("PMM Warning: pmm_free_contig called with NULL pointer\n");
         return;
     }
     
-    if (count == 0) {
-        kprintf("PMM Warning: pmm_free_pages called with count=0\n");
+    if (count == 0 || (uintptr_t)pages / PAGE_SIZE + count > total_pages) {
+        kprintf("PMM Error: Invalid contiguous free of %lu pages at 0x%lx\n",
+                count, (uintptr_t)pages);
         return;
     }
     
-    spin_lock(&pmm_lock);
-    size_t order = pages_to_order(count);
-    pmm_free_order(pages, order);
-    spin_unlock(&pmm_lock);
+    pmm_lock_acquire();
+    free_page_range((uintptr_t)pages / PAGE_SIZE, count);
+    pmm_lock_release();
+}
+
+// Claim a run of count pages aligned to align_pages, searching the default
+// zone and everything above it first so low memory is used last
+static void *alloc_range(size_t count, size_t align_pages, bool best_fit) {
+    size_t start = zones[default_zone].start_page;
+    size_t found = SIZE_MAX;
+    
+    for (int attempt = 0; attempt < 2 && found == SIZE_MAX; attempt++) {
+        // Cached frames could be splitting a run that would otherwise fit
+        if (attempt) pmm_drain_local_cache();
+        
+        pmm_lock_acquire();
+        found = find_run(start, total_pages, count, align_pages, best_fit);
+        if (found == SIZE_MAX && start > FIRST_MB_PAGES) {
+            found = find_run(FIRST_MB_PAGES, start, count, align_pages, best_fit);
+        }
+        if (found != SIZE_MAX && !claim_range(found, count)) {
+            found = SIZE_MAX;
+        }
+        // Bring everything online before the final attempt
+        if (found == SIZE_MAX && !attempt) {
+            while (deferred_init_one());
+        }
+        pmm_lock_release();
+    }
+    
+    return found == SIZE_MAX ? NULL : (void *)(found * PAGE_SIZE);
+}
+
+void *pmm_alloc_range(size_t count, size_t align, bool best_fit) {
+    if (count == 0) {
+        kprintf("PMM Warning: pmm_alloc_range called with count=0\n");
+        return NULL;
+    }
+    
+    if (align & (align - 1) || align > CMA_MAX_ALIGN) {
+        kprintf("PMM Error: Invalid range alignment 0x%lx\n", align);
+        return NULL;
+    }
+    
+    void *pages = alloc_range(count, align > PAGE_SIZE ? align / PAGE_SIZE : 1, best_fit);
+    if (!pages) {
+        kprintf("PMM Critical: Failed to allocate a run of %lu pages\n", count);
+    }
+    return pages;
 }
 
 void *pmm_alloc_aligned(size_t size, size_t alignment) {
@@ -436,27 +2077,26 @@ void *pmm_alloc_aligned(size_t size, size_t alignment) {
         return NULL;
     }
     
-    spin_lock(&pmm_lock);
+    if (alignment & (alignment - 1) || alignment > CMA_MAX_ALIGN) {
+        kprintf("PMM Error: Invalid alignment 0x%lx\n", alignment);
+        return NULL;
+    }
+    
     size_t pages = BYTES_TO_PAGES(size);
     size_t order = pages_to_order(pages);
+    void *block;
     
-    if (alignment <= (PAGE_SIZE << order)) {
-        void *block = pmm_alloc_order(order);
-        spin_unlock(&pmm_lock);
-        
-        if (!block) {
-            kprintf("PMM Error: Failed to allocate %d bytes with alignment %d\n", 
-                    size, alignment);
-        }
-        
-        return block;
+    // Buddy blocks are naturally aligned to their size, so only larger
+    // alignments need the range allocator. Both paths allocate exactly
+    // pages, which is what pmm_free_aligned gives back.
+    if (pages <= PMM_MAX_CONTIGUOUS_PAGES && alignment <= PAGES_TO_BYTES(1UL << order)) {
+        block = alloc_block(default_zone, numa_local_node(), order, pages);
+    } else {
+        block = alloc_range(pages, alignment / PAGE_SIZE, false);
     }
     
-    void *block = pmm_alloc_order(pages_to_order(alignment / PAGE_SIZE));
-    spin_unlock(&pmm_lock);
-    
     if (!block) {
-        kprintf("PMM Error: Failed to allocate aligned block (size=%d, align=%d)\n",
+        kprintf("PMM Error: Failed to allocate aligned block (size=%lu, align=0x%lx)\n",
                 size, alignment);
     }
     
@@ -474,11 +2114,89 @@ void pmm_free_aligned(void *ptr, size_t size) {
         return;
     }
     
-    spin_lock(&pmm_lock);
-    size_t pages = BYTES_TO_PAGES(size);
-    size_t order = pages_to_order(pages);
-    pmm_free_order(ptr, order);
-    spin_unlock(&pmm_lock);
+    pmm_lock_acquire();
+    free_page_range((uintptr_t)ptr / PAGE_SIZE, BYTES_TO_PAGES(size));
+    pmm_lock_release();
+}
+
+// Hand bootloader- and ACPI-reclaimable memory to the buddy allocator. Only
+// call this once nothing needs the Limine responses (memmap, HHDM, ...) any
+// more: vmm_init and every other consumer must be done. ACPI tables are
+// copied out first, so acpi_find_table keeps working.
+bool pmm_online_range(void *phys, size_t count) {
+    size_t first = (uintptr_t)phys / PAGE_SIZE;
+    if (!sections || !count || first + count > total_pages) {
+        kprintf("PMM Error: Cannot bring %lu pages at 0x%lx online\n", count, (uintptr_t)phys);
+        return false;
+    }
+    
+    bool ok = true;
+    pmm_lock_acquire();
+    for (size_t sec = first >> PMM_SECTION_SHIFT;
+         sec <= (first + count - 1) >> PMM_SECTION_SHIFT; sec++) {
+        if (sections[sec].pages) {
+            continue;
+        }
+        if (sections[sec].bitmap == absent_bitmap) {
+            ok = false;
+            break;
+        }
+        // Deferred slots all lie at or past deferred_slot
+        size_t slot = deferred_slot;
+        while (slot_section[slot] != sec) {
+            slot++;
+        }
+        deferred_online(sec, slot);
+    }
+    pmm_lock_release();
+    
+    if (!ok) {
+        kprintf("PMM Error: 0x%lx is not managed memory\n", (uintptr_t)phys);
+    }
+    return ok;
+}
+
+void pmm_reclaim_boot_memory(void) {
+    if (!sections || boot_memory_reclaimed) {
+        return;
+    }
+    
+    acpi_save_tables();
+    
+    // We are still running on the stack Limine handed us, which lives in
+    // bootloader-reclaimable memory, so leave that region alone
+    uintptr_t rsp;
+    asm volatile("mov %%rsp, %0" : "=r"(rsp));
+    size_t stack_page = (rsp >= hhdm_offset ? rsp - hhdm_offset : rsp) / PAGE_SIZE;
+    
+    size_t reclaimed = 0;
+    pmm_lock_acquire();
+    for (size_t i = 0; i < reclaim_range_count; i++) {
+        size_t start = reclaim_ranges[i].start;
+        size_t end = reclaim_ranges[i].end;
+        
+        if (stack_page >= start && stack_page < end) {
+            continue;
+        }
+        if (start < FIRST_MB_PAGES) {
+            start = FIRST_MB_PAGES;
+        }
+        if (end > total_pages) {
+            end = total_pages;
+        }
+        if (start >= end) {
+            continue;
+        }
+        
+        free_page_range(start, end - start);
+        zone_account_range(start, end);
+        reclaimed += end - start;
+    }
+    boot_memory_reclaimed = true;
+    zone_setup_watermarks();
+    pmm_lock_release();
+    
+    kprintf("PMM: Reclaimed %lu KB of bootloader/ACPI memory\n", PAGES_TO_BYTES(reclaimed) / 1024);
 }
 
 // Stats functions
@@ -487,11 +2205,11 @@ size_t pmm_get_total_memory(void) {
 }
 
 size_t pmm_get_used_memory(void) {
-    size_t used = 0;
-    for (size_t i = 0; i < total_pages; i++) {
-        if (bitmap_test(i)) used++;
-    }
-    return PAGES_TO_BYTES(used);
+    // Frames in the per-CPU caches are allocated from the buddy system's
+    // point of view but still free for callers, and so are the usable pages
+    // of deferred sections, which come online when allocations need them
+    return PAGES_TO_BYTES(total_pages - free_page_count - pcp_cached_pages() - zero_pool_count -
+                          deferred_pages);
 }
 
 size_t pmm_get_free_memory(void) {
@@ -499,15 +2217,25 @@ size_t pmm_get_free_memory(void) {
 }
 
 void *pmm_alloc_page_zeroed(void) {
-    void *page = pmm_alloc_page();
+    void *page = zero_pool_pop();
+    if (page) {
+        zero_pool_hits++;
+        return page;
+    }
+    
+    zero_pool_misses++;
+    page = pmm_alloc_page();
     if (page) {
         void *virt = (void *)((uintptr_t)page + hhdm_offset);
         memset(virt, 0, PAGE_SIZE);
     }
     return page;
 }
-
 void *pmm_alloc_pages_zeroed(size_t count) {
+    if (count == 1) {
+        return pmm_alloc_page_zeroed();
+    }
+    
     void *pages = pmm_alloc_pages(count);
     if (pages) {
         void *virt = (void *)((uintptr_t)pages + hhdm_offset);
@@ -517,21 +2245,44 @@ void *pmm_alloc_pages_zeroed(size_t count) {
 }
 
 
+struct page *pmm_phys_to_page(void *phys) {
+    size_t index = (uintptr_t)phys / PAGE_SIZE;
+    if (!sections || !pfn_valid(index)) {
+        return NULL;
+    }
+    return index_to_page(index);
+}
+
+struct page *pmm_virt_to_page(const void *virt) {
+    if ((uintptr_t)virt < hhdm_offset) {
+        return NULL;
+    }
+    return pmm_phys_to_page(pmm_virt_to_phys(virt));
+}
+
+void *pmm_page_to_phys(struct page *page) {
+    return (void *)(page_to_index(page) * PAGE_SIZE);
+}
+
+void *pmm_phys_to_virt(void *phys) {
+    return (void *)((uintptr_t)phys + hhdm_offset);
+}
+
+void *pmm_virt_to_phys(const void *virt) {
+    return (void *)((uintptr_t)virt - hhdm_offset);
+}
+
 void pmm_ref_page(void *page) {
-    if (!page || !page_refcounts) return; 
-    size_t index = (uintptr_t)page / PAGE_SIZE;
-    if (index < total_pages) {
-        __sync_fetch_and_add(&page_refcounts[index], 1);
+    struct page *desc = page ? pmm_phys_to_page(page) : NULL;
+    if (desc) {
+        __sync_fetch_and_add(&desc->refcount, 1);
     }
 }
 
 void pmm_unref_page(void *page) {
-    if (!page || !page_refcounts) return; 
-    size_t index = (uintptr_t)page / PAGE_SIZE;
-    if (index < total_pages) {
-        if (__sync_fetch_and_sub(&page_refcounts[index], 1) == 1) {
-            pmm_free_page(page);
-        }
+    struct page *desc = page ? pmm_phys_to_page(page) : NULL;
+    if (desc && __sync_fetch_and_sub(&desc->refcount, 1) == 1) {
+        pmm_free_page(page);
     }
 }
 
@@ -544,16 +2295,138 @@ void pmm_print_stats(void) {
     kprintf("  Total: %d MB\n", total);
     kprintf("  Used:  %d MB\n", used);
     kprintf("  Free:  %d MB\n", free);
+    kprintf("  Deferred: %lu of %lu sections not yet online (%lu MB of the free memory)\n",
+            deferred_sections, present_sections, PAGES_TO_BYTES(deferred_pages) / (1024 * 1024));
+    
+    kprintf("\nZones:\n");
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+        pmm_zone_t *zone = &zones[z];
+        if (!zone->managed_pages) continue;
+        kprintf("  %s%s: %lu MB managed, %lu MB free, watermarks low %lu high %lu pages\n",
+                zone->name, z == default_zone ? " (default)" : "",
+                PAGES_TO_BYTES(zone->managed_pages) / (1024 * 1024),
+                PAGES_TO_BYTES(zone->free_page_count) / (1024 * 1024),
+                zone->watermark_low, zone->watermark_high);
+    }
+    
+    if (numa_node_count() > 1) {
+        kprintf("\nNUMA nodes:\n");
+        for (size_t n = 0; n < numa_node_count(); n++) {
+            kprintf("  Node %lu%s: %lu MB managed, %lu MB free, %lu local / %lu remote allocs\n",
+                    n, (int)n == numa_local_node() ? " (local)" : "",
+                    PAGES_TO_BYTES(nodes[n].managed_pages) / (1024 * 1024),
+                    PAGES_TO_BYTES(nodes[n].free_page_count) / (1024 * 1024),
+                    nodes[n].local_allocs, nodes[n].remote_allocs);
+        }
+    }
+    
     kprintf("\nFree list distribution:\n");
     for (size_t i = PMM_MIN_ORDER; i <= PMM_MAX_ORDER; i++) {
-        int count = 0;
-        for (free_block_t *b = free_lists[i]; b != NULL; b = b->next) {
-            count++;
+        size_t count = 0;
+        for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+            count += zones[z].free_block_counts[i];
         }
         if (count > 0) {
-            kprintf("  Order %d (%d pages): %d blocks\n", i, 1 << i, count);
+            kprintf("  Order %d (%d pages): %lu blocks\n", i, 1 << i, count);
+        }
+    }
+    
+    uint64_t hits = 0, refills = 0, drains = 0;
+    for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        hits += pcp_caches[cpu].hits;
+        refills += pcp_caches[cpu].refills;
+        drains += pcp_caches[cpu].drains;
+    }
+    kprintf("\nPer-CPU page cache:\n");
+    kprintf("  Cached: %lu pages, hits: %lu, refills: %lu, drains: %lu\n",
+            pcp_cached_pages(), hits, refills, drains);
+    kprintf("  pmm_lock acquisitions: %lu\n", pmm_lock_count);
+    kprintf("Exact-size allocations: %lu pages returned from rounded blocks\n",
+            exact_pages_saved);
+    kprintf("Zeroed page pool: %lu/%d pages, hits: %lu, misses: %lu\n",
+            zero_pool_count, ZERO_POOL_SIZE, zero_pool_hits, zero_pool_misses);
+    
+    kprintf("\nCompaction: %lu runs, %lu succeeded, %lu pages migrated\n",
+            compact_runs, compact_successes, pages_migrated);
+    kprintf("Fragmentation index (-1 = block available):\n");
+    for (size_t i = 1; i <= PMM_MAX_ORDER; i++) {
+        kprintf("  Order %d: %d\n", i, pmm_fragmentation_index(i));
+    }
+}
+
+// Cross-check the incremental counters against a full bitmap scan and a
+// walk of every free list. Slow, meant for tests and debugging only.
+bool pmm_check_counters(void) {
+    bool ok = true;
+    
+    pmm_lock_acquire();
+    
+    size_t unset = total_pages - bitmap_count_used(0, total_pages);
+    
+    for (size_t w = 0; w < bitmap_words; w++) {
+        uint64_t word = *bitmap_word(w);
+        bool has_free = l1_has_free[w / 64] & (1UL << (w % 64));
+        bool all_free = l1_all_free[w / 64] & (1UL << (w % 64));
+        if (has_free != (word != ~0UL) || all_free != (word == 0)) {
+            kprintf("PMM Check: summary out of date for pages %lu-%lu\n", w * 64, w * 64 + 63);
+            ok = false;
+            break;
+        }
+    }
+    for (size_t g = 0; g < l1_words; g++) {
+        bool has_free = l2_has_free[g / 64] & (1UL << (g % 64));
+        bool all_free = l2_all_free[g / 64] & (1UL << (g % 64));
+        if (has_free != (l1_has_free[g] != 0) || all_free != (l1_all_free[g] == ~0UL)) {
+            kprintf("PMM Check: level 2 summary out of date for pages %lu-%lu\n",
+                    g * 4096, g * 4096 + 4095);
+            ok = false;
+            break;
+        }
+    }
+    
+    if (unset != free_page_count) {
+        kprintf("PMM Check: free page counter %lu, bitmap says %lu\n", free_page_count, unset);
+        ok = false;
+    }
+    
+    if (!deferred_sections && deferred_pages) {
+        kprintf("PMM Check: %lu deferred pages left with no deferred sections\n", deferred_pages);
+        ok = false;
+    }
+    
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+        pmm_zone_t *zone = &zones[z];
+        size_t zone_pages = 0;
+        
+        for (size_t i = PMM_MIN_ORDER; i <= PMM_MAX_ORDER; i++) {
+            size_t count = 0;
+            for (size_t n = 0; n < numa_node_count(); n++) {
+                for (struct page *b = zone->free_lists[n][i]; b != NULL; b = b->next) {
+                    if (!is_block_free(page_to_index(b), i) || b->node != n) {
+                        kprintf("PMM Check: free block at page %lu (order %d) marked used "
+                                "or on node %d's list\n", page_to_index(b), i, n);
+                        ok = false;
+                    }
+                    count++;
+                }
+            }
+            if (count != zone->free_block_counts[i]) {
+                kprintf("PMM Check: zone %s order %d counter %lu, free list has %lu blocks\n",
+                        zone->name, i, zone->free_block_counts[i], count);
+                ok = false;
+            }
+            zone_pages += count << i;
+        }
+        
+        if (zone_pages != zone->free_page_count) {
+            kprintf("PMM Check: zone %s free counter %lu, free lists hold %lu pages\n",
+                    zone->name, zone->free_page_count, zone_pages);
+            ok = false;
         }
     }
+    
+    pmm_lock_release();
+    return ok;
 }
 
 void test_pmm(void) {
@@ -570,8 +2443,343 @@ void test_pmm(void) {
         kprintf("8 pages: 0x%lx\n", (uintptr_t)p2);
     }
     
+    void *p3 = pmm_alloc_pages_zone(4, ZONE_DMA);
+    if (p3) {
+        kprintf("4 DMA pages: 0x%lx %s\n", (uintptr_t)p3,
+                (uintptr_t)p3 + PAGES_TO_BYTES(4) <= ZONE_DMA_LIMIT ? "y" : "n");
+    }
+    
+    // Larger than any buddy block, so it comes from the contiguous allocator
+    void *p4 = pmm_alloc_contig(4096, LARGE_PAGE_SIZE);
+    if (p4) {
+        kprintf("16 MB contiguous: 0x%lx %s\n", (uintptr_t)p4,
+                IS_LARGE_PAGE_ALIGNED((uintptr_t)p4) ? "y" : "n");
+    }
+    
+    // A node-specific allocation should land on the node asked for, even
+    // when it isn't the local one
+    void *p5 = NULL;
+    if (numa_node_count() > 1) {
+        int node = (numa_local_node() + 1) % numa_node_count();
+        p5 = pmm_alloc_pages_node(16, node);
+        if (p5) {
+            kprintf("16 pages on node %d: 0x%lx %s\n", node, (uintptr_t)p5,
+                    pmm_phys_to_page(p5)->node == node ? "y" : "n");
+        }
+    }
+    
+    kprintf("Counter self-check (allocated): %s\n", pmm_check_counters() ? "ok" : "FAILED");
+    
+    // The word-level scans must agree with the blocks just handed out
+    size_t run = bitmap_find_free_run(FIRST_MB_PAGES, total_pages, 300, 1);
+    bool run_ok = run != SIZE_MAX && bitmap_range_free(run, 300) &&
+                  (run == FIRST_MB_PAGES || bitmap_test(run - 1));
+    kprintf("Bitmap scans: 300-page free run at 0x%lx %s, 8-page block %s\n",
+            PAGES_TO_BYTES(run), run_ok ? "ok" : "FAILED",
+            p2 && bitmap_count_used((uintptr_t)p2 / PAGE_SIZE, 8) == 8 ? "ok" : "FAILED");
+    
     pmm_free_page(p1);
     pmm_free_pages(p2, 8);
+    if (p3) pmm_free_pages(p3, 4);
+    if (p4) pmm_free_contig(p4, 4096);
+    if (p5) pmm_free_pages(p5, 16);
     kprintf("After freeing:\n");
     pmm_print_stats();
-}
\ No newline at end of file
+    kprintf("Counter self-check (freed): %s\n", pmm_check_counters() ? "ok" : "FAILED");
+}
+
+// Map a few movable pages, then take the whole contiguous area so they have
+// to be migrated out of it, and check the data followed the mappings
+#define COMPACT_TEST_PAGES 8
+#define COMPACT_TEST_VIRT  0xFFFFC00000000000UL
+
+void test_compaction(void) {
+    kprintf("Testing compaction...\n");
+    
+    size_t cma_pages = zones[ZONE_CMA].managed_pages;
+    if (!cma_pages) {
+        kprintf("Compaction test skipped: no contiguous memory area\n");
+        return;
+    }
+    
+    uintptr_t phys[COMPACT_TEST_PAGES];
+    size_t mapped = 0;
+    for (; mapped < COMPACT_TEST_PAGES; mapped++) {
+        uint64_t virt = COMPACT_TEST_VIRT + PAGES_TO_BYTES(mapped);
+        phys[mapped] = (uintptr_t)pmm_alloc_page_movable(kernel_pml4, virt);
+        if (!phys[mapped]) break;
+        vmm_map_page(kernel_pml4, virt, phys[mapped], PTE_KERNEL_DATA);
+        memset((void *)virt, 0xA0 + mapped, PAGE_SIZE);
+    }
+    
+    void *area = pmm_alloc_contig(cma_pages, 0);
+    
+    size_t moved = 0;
+    bool intact = true;
+    for (size_t i = 0; i < mapped; i++) {
+        uint8_t *virt = (uint8_t *)(COMPACT_TEST_VIRT + PAGES_TO_BYTES(i));
+        uintptr_t now = vmm_get_physical_address(kernel_pml4, (uint64_t)virt);
+        struct page *desc = pmm_phys_to_page((void *)now);
+        
+        if (now != phys[i]) moved++;
+        if (virt[0] != (uint8_t)(0xA0 + i) || virt[PAGE_SIZE - 1] != (uint8_t)(0xA0 + i) ||
+            !desc || !(desc->flags & PAGE_FLAG_MOVABLE) || desc->virt != (uint64_t)virt) {
+            intact = false;
+        }
+    }
+    kprintf("Whole contiguous area (%lu pages) at 0x%lx: %lu/%lu movable pages migrated, data %s\n",
+            cma_pages, (uintptr_t)area, moved, mapped, intact ? "ok" : "FAILED");
+    
+    if (area) pmm_free_contig(area, cma_pages);
+    for (size_t i = 0; i < mapped; i++) {
+        uint64_t virt = COMPACT_TEST_VIRT + PAGES_TO_BYTES(i);
+        uintptr_t now = vmm_get_physical_address(kernel_pml4, virt);
+        vmm_unmap_page(kernel_pml4, virt);
+        pmm_free_page((void *)now);
+    }
+    
+    kprintf("Order 9 fragmentation index %d, compaction %s\n",
+            pmm_fragmentation_index(9), pmm_compact(9) ? "ok" : "found nothing to move");
+    kprintf("Counter self-check (compaction): %s\n", pmm_check_counters() ? "ok" : "FAILED");
+}
+
+// Free-path stress benchmark: allocate up to 100k single pages, then free
+// them in shuffled order so almost every free lands next to a used buddy
+// (scattered) or has to coalesce across a long free list.
+#define BENCH_FREE_PAGES 100000
+
+void bench_pmm(void) {
+    kprintf("\n=== PMM Benchmark ===\n");
+
+    size_t count = BENCH_FREE_PAGES;
+    size_t array_pages = BYTES_TO_PAGES(count * sizeof(uintptr_t));
+    void *array_phys = pmm_alloc_pages(array_pages);
+    if (!array_phys) {
+        kprintf("Benchmark: failed to allocate page array\n");
+        return;
+    }
+    uintptr_t *pages = (uintptr_t *)((uintptr_t)array_phys + hhdm_offset);
+
+    size_t allocated = 0;
+    while (allocated < count) {
+        void *p = pmm_alloc_page();
+        if (!p) break;
+        pages[allocated++] = (uintptr_t)p;
+    }
+
+    // Fisher-Yates shuffle with a fixed xorshift seed so runs are comparable
+    uint64_t seed = 0x2545F4914F6CDD1DUL;
+    for (size_t i = allocated; i > 1; i--) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        size_t j = seed % i;
+        uintptr_t tmp = pages[i - 1];
+        pages[i - 1] = pages[j];
+        pages[j] = tmp;
+    }
+
+    // pmm_free_page would park these in the per-CPU cache. Start from an
+    // empty cache and free through pmm_free_pages, which always goes
+    // through the buddy coalescing path, so runs compare with the baseline.
+    pmm_drain_local_cache();
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < allocated; i++) {
+        pmm_free_pages((void *)pages[i], 1);
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    kprintf("Scattered free: %lu pages, %lu cycles total, %lu cycles/free\n",
+            allocated, cycles, allocated ? cycles / allocated : 0);
+
+    pmm_free_pages(array_phys, array_pages);
+
+    // Single-page churn: with the per-CPU cache most of these never touch
+    // pmm_lock, so report lock acquisitions per operation as well
+    uint64_t locks_before = pmm_lock_count;
+    start = rdtsc();
+    for (size_t round = 0; round < 64; round++) {
+        void *batch[32];
+        for (size_t i = 0; i < 32; i++) {
+            batch[i] = pmm_alloc_page();
+        }
+        for (size_t i = 0; i < 32; i++) {
+            if (batch[i]) pmm_free_page(batch[i]);
+        }
+    }
+    cycles = rdtsc() - start;
+    uint64_t locks = pmm_lock_count - locks_before;
+
+    kprintf("Single-page churn: 4096 alloc/free pairs, %lu cycles/pair, "
+            "%lu lock acquisitions\n", cycles / 4096, locks);
+
+    // 4096 single frames, one pmm_alloc_page call at a time versus one bulk
+    // call, each followed by the matching free
+    #define BENCH_BULK_PAGES 4096
+    void *bulk_phys = pmm_alloc_pages(BYTES_TO_PAGES(BENCH_BULK_PAGES * sizeof(void *)));
+    if (bulk_phys) {
+        void **frames = (void **)((uintptr_t)bulk_phys + hhdm_offset);
+        
+        locks_before = pmm_lock_count;
+        start = rdtsc();
+        for (size_t i = 0; i < BENCH_BULK_PAGES; i++) {
+            frames[i] = pmm_alloc_page();
+        }
+        uint64_t loop_alloc = rdtsc() - start;
+        start = rdtsc();
+        for (size_t i = 0; i < BENCH_BULK_PAGES; i++) {
+            if (frames[i]) pmm_free_page(frames[i]);
+        }
+        uint64_t loop_free = rdtsc() - start;
+        uint64_t loop_locks = pmm_lock_count - locks_before;
+        
+        locks_before = pmm_lock_count;
+        start = rdtsc();
+        size_t got = pmm_alloc_pages_bulk(BENCH_BULK_PAGES, frames);
+        uint64_t bulk_alloc = rdtsc() - start;
+        start = rdtsc();
+        pmm_free_pages_bulk(got, frames);
+        uint64_t bulk_free = rdtsc() - start;
+        uint64_t bulk_locks = pmm_lock_count - locks_before;
+        
+        kprintf("4096 pages in a loop: alloc %lu cycles, free %lu cycles, %lu lock acquisitions\n",
+                loop_alloc, loop_free, loop_locks);
+        kprintf("4096 pages in bulk:   alloc %lu cycles, free %lu cycles, %lu lock acquisitions\n",
+                bulk_alloc, bulk_free, bulk_locks);
+        
+        pmm_free_pages(bulk_phys, BYTES_TO_PAGES(BENCH_BULK_PAGES * sizeof(void *)));
+    }
+
+    // Mixed-size workload: the same request sizes through the rounding and
+    // the exact path, comparing how much memory each actually consumed
+    #define BENCH_MIXED_ALLOCS 64
+    size_t sizes[BENCH_MIXED_ALLOCS];
+    void *blocks[BENCH_MIXED_ALLOCS];
+    size_t requested = 0;
+    for (size_t i = 0; i < BENCH_MIXED_ALLOCS; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        sizes[i] = 1 + seed % 200;
+        requested += sizes[i];
+    }
+
+    for (int exact = 0; exact <= 1; exact++) {
+        pmm_drain_local_cache();
+        size_t free_before = pmm_get_free_memory();
+        for (size_t i = 0; i < BENCH_MIXED_ALLOCS; i++) {
+            blocks[i] = exact ? pmm_alloc_pages_exact(sizes[i]) : pmm_alloc_pages(sizes[i]);
+        }
+        size_t consumed = (free_before - pmm_get_free_memory()) / PAGE_SIZE;
+        for (size_t i = 0; i < BENCH_MIXED_ALLOCS; i++) {
+            if (!blocks[i]) continue;
+            if (exact) {
+                pmm_free_pages_exact(blocks[i], sizes[i]);
+            } else {
+                pmm_free_pages(blocks[i], sizes[i]);
+            }
+        }
+        kprintf("Mixed sizes (%s): %lu pages requested, %lu pages consumed, %lu wasted\n",
+                exact ? "exact" : "rounded", requested, consumed, consumed - requested);
+    }
+
+    // Buddy alloc/free cost per order. With the word bitmap and its
+    // summaries, marking a block no longer depends on its size; what this
+    // measures is how deep each order splits on alloc and merges on free.
+    #define BENCH_ORDER_BLOCKS 16
+    void *order_blocks[BENCH_ORDER_BLOCKS];
+    kprintf("Per-order cost (%d blocks each, cycles/op):\n", BENCH_ORDER_BLOCKS);
+    for (size_t order = PMM_MIN_ORDER; order <= PMM_MAX_ORDER; order++) {
+        size_t block_pages = 1UL << order;
+        if (pmm_get_free_memory() / PAGE_SIZE < 2 * BENCH_ORDER_BLOCKS * block_pages) {
+            break;
+        }
+        
+        size_t got = 0;
+        start = rdtsc();
+        for (; got < BENCH_ORDER_BLOCKS; got++) {
+            order_blocks[got] = pmm_alloc_pages(block_pages);
+            if (!order_blocks[got]) break;
+        }
+        uint64_t alloc_cycles = rdtsc() - start;
+        
+        start = rdtsc();
+        for (size_t i = 0; i < got; i++) {
+            pmm_free_pages(order_blocks[i], block_pages);
+        }
+        uint64_t free_cycles = rdtsc() - start;
+        
+        if (got) {
+            kprintf("  Order %d: alloc %lu, free %lu\n",
+                    order, alloc_cycles / got, free_cycles / got);
+        }
+    }
+
+    // Fragmentation: carve 64MB into 16-page blocks and free three of every
+    // four, leaving 48-page holes. 40-page requests then need a whole order-6
+    // block through the buddy path, which the holes can't provide, so it
+    // splits large blocks elsewhere. The range allocator fits them into the
+    // holes and leaves the large blocks alone.
+    #define BENCH_FRAG_BLOCKS 1024
+    #define BENCH_FRAG_REQUESTS 256
+    #define BENCH_FRAG_RUN 40
+    size_t frag_array_pages = BYTES_TO_PAGES((BENCH_FRAG_BLOCKS + BENCH_FRAG_REQUESTS) * sizeof(void *));
+    void *frag_phys = pmm_alloc_pages(frag_array_pages);
+    if (frag_phys && pmm_get_free_memory() / PAGE_SIZE > 4 * BENCH_FRAG_BLOCKS * 16) {
+        void **frag = (void **)((uintptr_t)frag_phys + hhdm_offset);
+        void **runs = frag + BENCH_FRAG_BLOCKS;
+        
+        for (size_t i = 0; i < BENCH_FRAG_BLOCKS; i++) {
+            frag[i] = pmm_alloc_pages_exact(16);
+        }
+        for (size_t i = 0; i < BENCH_FRAG_BLOCKS; i++) {
+            if (frag[i] && i % 4) {
+                pmm_free_pages_exact(frag[i], 16);
+                frag[i] = NULL;
+            }
+        }
+        
+        for (int use_range = 0; use_range <= 1; use_range++) {
+            pmm_drain_local_cache();
+            size_t large_before = 0, large_after = 0, got = 0;
+            for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+                for (size_t o = 9; o <= PMM_MAX_ORDER; o++) {
+                    large_before += zones[z].free_block_counts[o];
+                }
+            }
+            
+            start = rdtsc();
+            for (size_t i = 0; i < BENCH_FRAG_REQUESTS; i++) {
+                runs[i] = use_range ? pmm_alloc_range(BENCH_FRAG_RUN, PAGE_SIZE, false)
+                                    : pmm_alloc_pages_exact(BENCH_FRAG_RUN);
+            }
+            cycles = rdtsc() - start;
+            
+            for (size_t i = 0; i < BENCH_FRAG_REQUESTS; i++) {
+                if (runs[i]) got++;
+            }
+            for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+                for (size_t o = 9; o <= PMM_MAX_ORDER; o++) {
+                    large_after += zones[z].free_block_counts[o];
+                }
+            }
+            
+            kprintf("Fragmented %d-page runs (%s): %lu allocs, %lu cycles/alloc, "
+                    "free order>=9 blocks %lu -> %lu\n",
+                    BENCH_FRAG_RUN, use_range ? "range" : "buddy", got,
+                    got ? cycles / got : 0, large_before, large_after);
+            
+            for (size_t i = 0; i < BENCH_FRAG_REQUESTS; i++) {
+                if (runs[i]) pmm_free_pages_exact(runs[i], BENCH_FRAG_RUN);
+            }
+        }
+        
+        for (size_t i = 0; i < BENCH_FRAG_BLOCKS; i++) {
+            if (frag[i]) pmm_free_pages_exact(frag[i], 16);
+        }
+    }
+    if (frag_phys) {
+        pmm_free_pages(frag_phys, frag_array_pages);
+    }
+    kprintf("=====================\n\n");
+}
@@ -7,6 +7,7 @@
 #include <kprintf.h>
 #include <string.h>
 #include <mm_constants.h>
+#include <pmm.h>
 
 // Data structures and function prototypes
 typedef struct _LIST_ENTRY {
@@ -53,9 +54,6 @@ struct _CACHE {
 
 #define CACHE_FLAG_BUFCTL 0x01
 
-extern void* pmm_alloc_pages(size_t pages);
-extern void pmm_free_pages(void* phys, size_t pages);
-
 static LIST_ENTRY cacheListHead = {&cacheListHead, &cacheListHead};
 static SPIN_LOCK globalLock = {0};
 
@@ -95,14 +93,56 @@ void spin_lock(SPIN_LOCK* lock) {
     __sync_synchronize();
 }
 
+// Take the lock only if it is free; returns nonzero on success
+int spin_trylock(SPIN_LOCK* lock) {
+    if (!lock) return 0;
+    if (__sync_lock_test_and_set(&lock->locked, 1)) return 0;
+    __sync_synchronize();
+    return 1;
+}
+
 void spin_unlock(SPIN_LOCK* lock) {
     if (!lock) return;
     __sync_synchronize();
     __sync_lock_release(&lock->locked);
 }
 
+static void destroy_slab(SLAB* slab);
+
+// Slabs sit on the cache lists by their listEntry, which is not the first field
+static SLAB* slab_from_entry(LIST_ENTRY* entry) {
+    return (SLAB*)((uintptr_t)entry - offsetof(SLAB, listEntry));
+}
+
+// Shrinker for the PMM: free the empty slabs of every cache. Caches whose
+// lock is held (possibly by an allocation that led here) are skipped.
+static size_t slab_shrink(void) {
+    size_t freed = 0;
+    
+    if (!spin_trylock(&globalLock)) return 0;
+    
+    for (LIST_ENTRY* e = cacheListHead.flink; e != &cacheListHead; e = e->flink) {
+        CACHE* cache = (CACHE*)((uintptr_t)e - offsetof(CACHE, listEntry));
+        if (!spin_trylock(&cache->lock)) continue;
+        
+        while (!is_list_empty(&cache->emptySlabListHead)) {
+            LIST_ENTRY* entry = cache->emptySlabListHead.flink;
+            SLAB* slab = slab_from_entry(entry);
+            remove_entry_list(entry);
+            destroy_slab(slab);
+            freed++;
+        }
+        
+        spin_unlock(&cache->lock);
+    }
+    
+    spin_unlock(&globalLock);
+    return freed;
+}
+
 void slab_init(void) {
     init_list_head(&cacheListHead);
+    pmm_register_shrinker(slab_shrink);
     kprintf("Slab allocator initialized\n");
 }
 
@@ -135,13 +175,20 @@ static SLAB* create_slab(CACHE* cache) {
         objects_per_slab = 1;
     }
     
-    SLAB* slab = (SLAB*)pmm_alloc_pages(1);
-    if (!slab) {
+    void* page = pmm_alloc_pages(1);
+    if (!page) {
         kprintf("Slab Critical: Failed to allocate page for slab (object size %d)\n", 
                 cache->size);
         return NULL;
     }
     
+    // Slabs are addressed through the HHDM; the descriptor points back at
+    // the slab so cache_free can find it from any object
+    SLAB* slab = (SLAB*)pmm_phys_to_virt(page);
+    struct page* desc = pmm_phys_to_page(page);
+    desc->flags |= PAGE_FLAG_CACHE_SLAB;
+    desc->private = slab;
+    
     slab->cache = cache;
     init_list_head(&slab->listEntry);
     slab->objectCount = objects_per_slab;
@@ -175,6 +222,13 @@ static SLAB* create_slab(CACHE* cache) {
     return slab;
 }
 
+static void destroy_slab(SLAB* slab) {
+    struct page* desc = pmm_virt_to_page(slab);
+    desc->flags &= ~PAGE_FLAG_CACHE_SLAB;
+    desc->private = NULL;
+    pmm_free_pages(pmm_virt_to_phys(slab), 1);
+}
+
 CACHE* cache_create(size_t size, int align, int flags) {
     if (size == 0) {
         kprintf("Slab Error: cache_create called with size=0\n");
@@ -187,11 +241,12 @@ CACHE* cache_create(size_t size, int align, int flags) {
         return NULL;
     }
     
-    CACHE* cache = (CACHE*)pmm_alloc_pages(1);
-    if (!cache) {
+    void* page = pmm_alloc_pages(1);
+    if (!page) {
         kprintf("Slab Critical: Failed to allocate page for cache (size %d)\n", size);
         return NULL;
     }
+    CACHE* cache = (CACHE*)pmm_phys_to_virt(page);
     
     cache->size = size;
     cache->align = align;
@@ -221,9 +276,9 @@ void* cache_alloc(CACHE* cache) {
     SLAB* slab = NULL;
     
     if (!is_list_empty(&cache->partialSlabListHead)) {
-        slab = (SLAB*)cache->partialSlabListHead.flink;
+        slab = slab_from_entry(cache->partialSlabListHead.flink);
     } else if (!is_list_empty(&cache->emptySlabListHead)) {
-        slab = (SLAB*)cache->emptySlabListHead.flink;
+        slab = slab_from_entry(cache->emptySlabListHead.flink);
         remove_entry_list(&slab->listEntry);
         insert_tail_list(&cache->partialSlabListHead, &slab->listEntry);
     } else {
@@ -241,7 +296,8 @@ void* cache_alloc(CACHE* cache) {
     
     if (cache->flags & CACHE_FLAG_BUFCTL) {
         if (!is_list_empty(&slab->u.bufferControlFreeListHead)) {
-            BUFCTRL* bufctl = (BUFCTRL*)slab->u.bufferControlFreeListHead.flink;
+            BUFCTRL* bufctl = (BUFCTRL*)((uintptr_t)slab->u.bufferControlFreeListHead.flink -
+                                          offsetof(BUFCTRL, entry));
             remove_entry_list(&bufctl->entry);
             obj = bufctl->buffer;
         } else {
@@ -285,7 +341,15 @@ void cache_free(CACHE* cache, void* obj) {
     spin_lock(&cache->lock);
     
     uintptr_t obj_addr = (uintptr_t)obj;
-    SLAB* slab = (SLAB*)PAGE_ALIGN_DOWN(obj_addr);
+    struct page* desc = pmm_virt_to_page(obj);
+    
+    if (!desc || !(desc->flags & PAGE_FLAG_CACHE_SLAB)) {
+        kprintf("Slab Error: cache_free on 0x%lx, not a slab object\n", obj_addr);
+        spin_unlock(&cache->lock);
+        return;
+    }
+    
+    SLAB* slab = (SLAB*)desc->private;
 
     if (slab->cache != cache) {
         kprintf("Slab PANIC: Slab corruption or wrong cache!\n");
@@ -355,21 +419,21 @@ void cache_destroy(CACHE* cache) {
     
     // Free all slabs
     while (!is_list_empty(&cache->fullSlabListHead)) {
-        SLAB* slab = (SLAB*)cache->fullSlabListHead.flink;
+        SLAB* slab = slab_from_entry(cache->fullSlabListHead.flink);
         remove_entry_list(&slab->listEntry);
-        pmm_free_pages(slab, 1);
+        destroy_slab(slab);
     }
     
     while (!is_list_empty(&cache->partialSlabListHead)) {
-        SLAB* slab = (SLAB*)cache->partialSlabListHead.flink;
+        SLAB* slab = slab_from_entry(cache->partialSlabListHead.flink);
         remove_entry_list(&slab->listEntry);
-        pmm_free_pages(slab, 1);
+        destroy_slab(slab);
     }
     
     while (!is_list_empty(&cache->emptySlabListHead)) {
-        SLAB* slab = (SLAB*)cache->emptySlabListHead.flink;
+        SLAB* slab = slab_from_entry(cache->emptySlabListHead.flink);
         remove_entry_list(&slab->listEntry);
-        pmm_free_pages(slab, 1);
+        destroy_slab(slab);
     }
     
     
@@ -380,7 +444,7 @@ void cache_destroy(CACHE* cache) {
     remove_entry_list(&cache->listEntry);
     spin_unlock(&globalLock);
     
-    pmm_free_pages(cache, 1);
+    pmm_free_pages(pmm_virt_to_phys(cache), 1);
 }
 
 void slab_print_stats(void) {
@@ -393,7 +457,7 @@ void slab_print_stats(void) {
          entry != &cacheListHead; 
          entry = entry->flink) {
         cache_count++;
-        CACHE* cache = (CACHE*)entry;
+        CACHE* cache = (CACHE*)((uintptr_t)entry - offsetof(CACHE, listEntry));
         
         spin_lock(&cache->lock);
         
@@ -403,7 +467,7 @@ void slab_print_stats(void) {
         for (LIST_ENTRY* e = cache->fullSlabListHead.flink; 
              e != &cache->fullSlabListHead; e = e->flink) {
             full++;
-            SLAB* s = (SLAB*)e;
+            SLAB* s = slab_from_entry(e);
             total_objs += s->objectCount;
             used_objs += s->usedObjects;
         }
@@ -411,7 +475,7 @@ void slab_print_stats(void) {
         for (LIST_ENTRY* e = cache->partialSlabListHead.flink; 
              e != &cache->partialSlabListHead; e = e->flink) {
             partial++;
-            SLAB* s = (SLAB*)e;
+            SLAB* s = slab_from_entry(e);
             total_objs += s->objectCount;
             used_objs += s->usedObjects;
         }
@@ -419,7 +483,7 @@ void slab_print_stats(void) {
         for (LIST_ENTRY* e = cache->emptySlabListHead.flink; 
              e != &cache->emptySlabListHead; e = e->flink) {
             empty++;
-            SLAB* s = (SLAB*)e;
+            SLAB* s = slab_from_entry(e);
             total_objs += s->objectCount;
         }
         
@@ -6,6 +6,8 @@
 #include <string.h>
 #include <limine.h>
 #include <slab.h>
+#include <cpu.h>
+#include <memblock.h>
 #include <mm_constants.h>
 
 extern volatile struct limine_hhdm_request hhdm_request;
@@ -14,18 +16,66 @@ extern volatile struct limine_executable_address_request kernel_address_request;
 
 uint64_t* kernel_pml4 = NULL;
 static uint64_t hhdm_offset = 0;
+static uint64_t* current_pml4 = NULL;
+
+// PCIDs are handed out in generations. An address space keeps its PCID
+// while its PML4 descriptor carries the current generation; when the
+// numbers run out a new generation starts and every space gets a new one
+// on its next switch. A PCID is always loaded with a flush the first time
+// it is used in a generation, so entries left by its previous owner go.
+static bool pcid_enabled = false;
+static bool pcid_keep_on_switch = true;     // cleared by the benchmark
+static uint64_t asid_generation = 1;
+static uint64_t next_asid = 1;
+static uint64_t asid_rollovers = 0;
 
 // Get index for a page table level (0=PT, 1=PD, 2=PDPT, 3=PML4)
 static uint64_t get_index(uint64_t virt, int level) {
     return (virt >> (PT_SHIFT + level * 9)) & PT_INDEX_MASK;
 }
 
+// The kernel half (PML4 entries 256-511) is shared by every address space
+static bool is_kernel_half(uint64_t virt) {
+    return get_index(virt, 3) >= 256;
+}
+
+// Leaf flags for a mapping at virt. Kernel-half mappings are global, so
+// they stay in the TLB across address-space switches.
+static uint64_t leaf_flags(uint64_t virt, uint64_t flags) {
+    return is_kernel_half(virt) ? flags | PTE_GLOBAL : flags;
+}
+
 // Convert physical address to virtual using HHDM
 static void* phys_to_virt(uint64_t phys) {
     return (void*)(phys + hhdm_offset);
 }
 
-// Switch to a different page table
+// Page tables built by vmm_init come from a block memblock reserved at the
+// top of memory before pmm_init (vmm_reserve_boot_tables); whatever it
+// doesn't use goes to the PMM at the end of vmm_init. Every other table
+// comes from the PMM.
+static uint64_t boot_tables_phys = 0;
+static size_t boot_tables_left = 0;
+static size_t tables_allocated = 0;
+
+static uint64_t alloc_table_page(void) {
+    uint64_t phys = 0;
+    if (boot_tables_left) {
+        phys = boot_tables_phys;
+        boot_tables_phys += PAGE_SIZE;
+        boot_tables_left--;
+    } else {
+        phys = (uint64_t)pmm_alloc_page();
+    }
+    
+    if (phys) {
+        tables_allocated++;
+    }
+    return phys;
+}
+
+// Switch to a different page table. With PCIDs the target keeps its TLB
+// entries from the last time it ran, unless its PCID had to be replaced.
 void vmm_switch_pml4(uint64_t* pml4) {
     if (!pml4) {
         kprintf("VMM Error: vmm_switch_pml4 called with NULL pml4\n");
@@ -33,7 +83,68 @@ void vmm_switch_pml4(uint64_t* pml4) {
     }
     
     uint64_t phys = (uint64_t)pml4 - hhdm_offset;
-    asm volatile("mov %0, %%cr3" :: "r"(phys) : "memory");
+    current_pml4 = pml4;
+    
+    if (!pcid_enabled) {
+        write_cr3(phys);
+        return;
+    }
+    
+    struct page* desc = pmm_virt_to_page(pml4);
+    if (desc->asid_generation == asid_generation) {
+        write_cr3(phys | desc->asid | (pcid_keep_on_switch ? CR3_NOFLUSH : 0));
+        return;
+    }
+    
+    if (next_asid == VMM_PCID_COUNT) {
+        asid_generation++;
+        asid_rollovers++;
+        next_asid = 1;
+    }
+    desc->asid = next_asid++;
+    desc->asid_generation = asid_generation;
+    write_cr3(phys | desc->asid);
+}
+
+// Invalidate everything, global entries and all PCIDs included
+static void flush_tlb_global(void) {
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4 | CR4_PGE);
+}
+
+// invlpg only reaches the current PCID's entries for virt, and global ones.
+// Kernel-half mappings are global, so that covers them; for the user half,
+// a space that isn't running gives up its PCID instead.
+//
+// Paging-structure caches are never global, so other PCIDs can still hold
+// a kernel-half page table that was freed (tables_freed). That takes a full
+// flush_tlb_global rather than a new PCID generation: freeing a kernel
+// table is rare (a 1GB page over an empty page directory), while a new
+// generation costs every address space a flush on its next switch.
+static void flush_other_asids(uint64_t* pml4, uint64_t virt, bool tables_freed) {
+    if (!pcid_enabled) {
+        return;
+    }
+    if (is_kernel_half(virt)) {
+        if (tables_freed) {
+            flush_tlb_global();
+        }
+    } else if (pml4 != current_pml4) {
+        pmm_virt_to_page(pml4)->asid_generation = 0;
+    }
+}
+
+// Invalidate the translation of virt after its entry in pml4 changed
+static void flush_page(uint64_t* pml4, uint64_t virt) {
+    asm volatile("invlpg (%0)" :: "r"(virt) : "memory");
+    flush_other_asids(pml4, virt, false);
+}
+
+// Same, after the page tables that mapped virt were freed as well
+static void flush_page_tables(uint64_t* pml4, uint64_t virt) {
+    asm volatile("invlpg (%0)" :: "r"(virt) : "memory");
+    flush_other_asids(pml4, virt, true);
 }
 
 // Map a single 4KB page
@@ -60,7 +171,7 @@ void vmm_map_page(uint64_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags)
         int index = get_index(virt, level);
         
         if (!(table[index] & PTE_PRESENT)) {
-            uint64_t new_table_phys = (uint64_t)pmm_alloc_page();
+            uint64_t new_table_phys = alloc_table_page();
             if (!new_table_phys) {
                 kprintf("VMM Critical: Failed to allocate page table at level %d for virt 0x%lx\n",
                         level, virt);
@@ -79,12 +190,16 @@ void vmm_map_page(uint64_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags)
     // Set the final PT entry
     int index = get_index(virt, 0);
     
-    if (table[index] & PTE_PRESENT) {
+    // A new entry can't be cached yet; only a replaced one needs a flush
+    bool replaced = table[index] & PTE_PRESENT;
+    if (replaced) {
         kprintf("VMM Warning: Remapping already mapped page at virt 0x%lx\n", virt);
     }
     
-    table[index] = phys | flags;
-    asm volatile("invlpg (%0)" :: "r" (virt) : "memory");
+    table[index] = phys | leaf_flags(virt, flags);
+    if (replaced) {
+        flush_page(pml4, virt);
+    }
 }
 
 // Map a 2MB huge page (more efficient for large regions)
@@ -111,7 +226,7 @@ void vmm_map_huge_page(uint64_t* pml4, uint64_t virt, uint64_t phys, uint64_t fl
         int index = get_index(virt, level);
         
         if (!(table[index] & PTE_PRESENT)) {
-            uint64_t new_table_phys = (uint64_t)pmm_alloc_page();
+            uint64_t new_table_phys = alloc_table_page();
             if (!new_table_phys) {
                 kprintf("VMM Critical: Failed to allocate page table at level %d for huge page\n",
                         level);
@@ -130,12 +245,123 @@ void vmm_map_huge_page(uint64_t* pml4, uint64_t virt, uint64_t phys, uint64_t fl
     // Map as 2MB page with PS bit set
     int index = get_index(virt, 1);
     
-    if (table[index] & PTE_PRESENT) {
+    bool replaced = table[index] & PTE_PRESENT;
+    if (replaced) {
         kprintf("VMM Warning: Remapping already mapped huge page at virt 0x%lx\n", virt);
     }
     
-    table[index] = phys | flags | PTE_HUGE;
-    asm volatile("invlpg (%0)" :: "r" (virt) : "memory");
+    table[index] = phys | leaf_flags(virt, flags) | PTE_HUGE;
+    if (replaced) {
+        flush_page(pml4, virt);
+    }
+}
+
+// Number of size-aligned regions that [base, end) touches
+static size_t regions_spanned(uint64_t base, uint64_t end, uint64_t size) {
+    return (end - 1) / size - base / size + 1;
+}
+
+// Merge memmap entries from *i on that touch (or share a page) into one
+// run [*base, *end) so their boundaries don't force small pages in the
+// HHDM. Returns false once the memmap is done.
+static bool next_hhdm_run(struct limine_memmap_response* memmap, size_t* i,
+                          uint64_t* base, uint64_t* end) {
+    if (*i >= memmap->entry_count) {
+        return false;
+    }
+    
+    *base = memmap->entries[*i]->base;
+    *end = *base + memmap->entries[*i]->length;
+    for ((*i)++; *i < memmap->entry_count && memmap->entries[*i]->base <= PAGE_ALIGN_UP(*end);
+         (*i)++) {
+        uint64_t next_end = memmap->entries[*i]->base + memmap->entries[*i]->length;
+        if (next_end > *end) *end = next_end;
+    }
+    return true;
+}
+
+// Upper bound on the tables needed to map [virt, virt + length) in 4KB pages
+static size_t tables_for_4k(uint64_t virt, uint64_t length) {
+    uint64_t end = PAGE_ALIGN_UP(virt + length);
+    virt = PAGE_ALIGN_DOWN(virt);
+    return regions_spanned(virt, end, LARGE_PAGE_SIZE) +
+           regions_spanned(virt, end, HUGE_PAGE_1G_SIZE) +
+           regions_spanned(virt, end, PT_ENTRIES * HUGE_PAGE_1G_SIZE);
+}
+
+void vmm_reserve_boot_tables(struct limine_memmap_response* memmap) {
+    if (!memmap || !hhdm_request.response || !kernel_address_request.response) {
+        return;
+    }
+    
+    uint64_t hhdm = hhdm_request.response->offset;
+    struct limine_executable_address_response* kaddr = kernel_address_request.response;
+    size_t tables = 1;      // the PML4
+    
+    for (size_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry* e = memmap->entries[i];
+        if (e->type == LIMINE_MEMMAP_EXECUTABLE_AND_MODULES) {
+            tables += tables_for_4k(e->base + (kaddr->virtual_base - kaddr->physical_base),
+                                    e->length);
+        } else if (e->type == LIMINE_MEMMAP_FRAMEBUFFER) {
+            tables += tables_for_4k(e->base, e->length);
+        }
+    }
+    
+    // Same runs as vmm_init. A 2MB-aligned HHDM needs 4KB pages (and page
+    // tables) only at the two unaligned edges of a run; a PD per 1GB is an
+    // upper bound even when 1GB pages are used.
+    uint64_t base, end;
+    for (size_t i = 0; next_hhdm_run(memmap, &i, &base, &end); ) {
+        base = PAGE_ALIGN_DOWN(base) + hhdm;
+        end = PAGE_ALIGN_UP(end) + hhdm;
+        size_t pts = regions_spanned(base, end, LARGE_PAGE_SIZE);
+        if (IS_LARGE_PAGE_ALIGNED(hhdm) && pts > 2) {
+            pts = 2;
+        }
+        tables += pts + regions_spanned(base, end, HUGE_PAGE_1G_SIZE) +
+                  regions_spanned(base, end, PT_ENTRIES * HUGE_PAGE_1G_SIZE);
+    }
+    
+    // From the top like the PMM metadata, so it stays out of DMA32
+    boot_tables_phys = memblock_alloc_high(PAGES_TO_BYTES(tables), PAGE_SIZE);
+    if (!boot_tables_phys) {
+        kprintf("VMM Warning: No early memory for %lu boot page tables, using the PMM\n", tables);
+        return;
+    }
+    
+    // memblock memory isn't zeroed; tables are cleared as they're taken
+    boot_tables_left = tables;
+    kprintf("VMM: Reserved %lu boot page tables\n", tables);
+}
+
+// Map a physical run into the HHDM with the largest pages that fit: 1GB
+// pages if the CPU has them, 2MB pages, and 4KB pages at unaligned edges.
+// counts[] collects the number of 1GB, 2MB and 4KB mappings.
+static void map_hhdm_run(uint64_t base, uint64_t length, bool use_1g, size_t counts[3]) {
+    uint64_t phys = PAGE_ALIGN_DOWN(base);
+    uint64_t end = PAGE_ALIGN_UP(base + length);
+    
+    while (phys < end) {
+        uint64_t virt = phys + hhdm_offset;
+        uint64_t left = end - phys;
+        
+        if (use_1g && !(virt & (HUGE_PAGE_1G_SIZE - 1)) && !(phys & (HUGE_PAGE_1G_SIZE - 1)) &&
+            left >= HUGE_PAGE_1G_SIZE &&
+            vmm_map_huge_page_1g(kernel_pml4, virt, phys, PTE_KERNEL_DATA)) {
+            phys += HUGE_PAGE_1G_SIZE;
+            counts[0]++;
+        } else if (IS_LARGE_PAGE_ALIGNED(virt) && IS_LARGE_PAGE_ALIGNED(phys) &&
+                   left >= LARGE_PAGE_SIZE) {
+            vmm_map_huge_page(kernel_pml4, virt, phys, PTE_KERNEL_DATA);
+            phys += LARGE_PAGE_SIZE;
+            counts[1]++;
+        } else {
+            vmm_map_page(kernel_pml4, virt, phys, PTE_KERNEL_DATA);
+            phys += PAGE_SIZE;
+            counts[2]++;
+        }
+    }
 }
 
 void vmm_init(void) {
@@ -146,8 +372,17 @@ void vmm_init(void) {
 
     hhdm_offset = hhdm_request.response->offset;
 
+    // The boot tables are PMM frames like any other once the PMM is up.
+    // The top of memory is usually deferred, so bring their section online.
+    if (boot_tables_left && !pmm_online_range((void*)boot_tables_phys, boot_tables_left)) {
+        kprintf("VMM Warning: Boot page tables at 0x%lx have no descriptors, not using them\n",
+                boot_tables_phys);
+        boot_tables_left = 0;
+    }
+    size_t boot_tables = boot_tables_left;
+
     // Allocate and zero kernel PML4
-    uint64_t phys_pml4 = (uint64_t)pmm_alloc_page();
+    uint64_t phys_pml4 = alloc_table_page();
     if (!phys_pml4) {
         kprintf("VMM Critical: Failed to allocate PML4\n");
         for (;;) asm("hlt");
@@ -155,12 +390,14 @@ void vmm_init(void) {
     
     kernel_pml4 = (uint64_t*)phys_to_virt(phys_pml4);
     memset(kernel_pml4, 0, PAGE_SIZE);
+    pmm_phys_to_page((void*)phys_pml4)->asid_generation = 0;
     kprintf("VMM: Created PML4 at Phys 0x%x\n", phys_pml4);
 
     struct limine_memmap_response *memmap = memmap_request.response;
     struct limine_executable_address_response *kaddr = kernel_address_request.response;
 
-    // Map kernel and modules
+    // Map kernel and modules. These and the HHDM are in the kernel half, so
+    // the map functions make them global.
     for (size_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *e = memmap->entries[i];
 
@@ -189,22 +426,60 @@ void vmm_init(void) {
         }
     }
 
-    // Map all physical memory via HHDM
+    // Map all physical memory via HHDM. Entries that touch (or share a page)
+    // are merged into runs so their boundaries don't force small pages.
     kprintf("VMM: Mapping HHDM...\n");
-    for (size_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry *e = memmap->entries[i];
-        size_t pages = BYTES_TO_PAGES(e->length);
-        
-        for (size_t j = 0; j < pages; j++) {
-            vmm_map_page(kernel_pml4, 
-                        e->base + PAGES_TO_BYTES(j) + hhdm_offset, 
-                        e->base + PAGES_TO_BYTES(j), 
-                        PTE_KERNEL_DATA);
-        }
+    bool use_1g = cpu_has_1g_pages();
+    size_t counts[3] = {0, 0, 0};
+    size_t tables_4k_only = 0;
+    size_t tables_before = tables_allocated;
+    uint64_t start = rdtsc();
+    
+    uint64_t base, end;
+    for (size_t i = 0; next_hhdm_run(memmap, &i, &base, &end); ) {
+        map_hhdm_run(base, end - base, use_1g, counts);
+        tables_4k_only += regions_spanned(base, end, LARGE_PAGE_SIZE) +
+                          regions_spanned(base, end, HUGE_PAGE_1G_SIZE);
     }
+    
+    uint64_t cycles = rdtsc() - start;
+    size_t tables = tables_allocated - tables_before;
+    kprintf("VMM: HHDM mapped with %lu x 1GB, %lu x 2MB, %lu x 4KB pages in %lu cycles\n",
+            counts[0], counts[1], counts[2], cycles);
+    kprintf("VMM: HHDM page tables %lu KB (about %lu KB with 4KB pages only)\n",
+            PAGES_TO_BYTES(tables) / 1024, PAGES_TO_BYTES(tables_4k_only) / 1024);
 
     kprintf("VMM: Switching Page Tables...\n");
     vmm_switch_pml4(kernel_pml4);
+    
+    // CR4.PCIDE can only be set while CR3 holds PCID 0, as it does now
+    if (cpu_has_pcid()) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+        pcid_enabled = true;
+    }
+    kprintf("VMM: PCID %s\n", pcid_enabled ? "enabled" : "not supported");
+    
+    // Kernel-half mappings are global from here on; turning CR4.PGE over
+    // also drops any global entries left from the bootloader's tables
+    flush_tlb_global();
+    kprintf("VMM: Global kernel mappings enabled\n");
+    
+    if (boot_tables) {
+        kprintf("VMM: %lu of %lu boot page tables used\n", boot_tables - boot_tables_left,
+                boot_tables);
+    }
+    // The leftover run starts wherever the used tables stopped, so it is
+    // rarely a naturally aligned block; free it as an exact page range
+    if (boot_tables_left) {
+        size_t free_before = pmm_get_free_memory();
+        pmm_free_pages_exact((void*)boot_tables_phys, boot_tables_left);
+        size_t returned = BYTES_TO_PAGES(pmm_get_free_memory() - free_before);
+        if (returned != boot_tables_left) {
+            kprintf("VMM Error: Returned %lu pages for %lu unused boot page tables\n",
+                    returned, boot_tables_left);
+        }
+        boot_tables_left = 0;
+    }
     kprintf("VMM: Initialization complete\n");
 }
 
@@ -226,6 +501,13 @@ void vmm_unmap_page(uint64_t* pml4, uint64_t virt) {
             return; // Already unmapped
         }
         
+        // A huge page goes as a whole
+        if (level < 3 && (table[index] & PTE_HUGE)) {
+            table[index] = 0;
+            flush_page(pml4, virt);
+            return;
+        }
+        
         uint64_t next_phys = table[index] & PTE_ADDR_MASK;
         table = (uint64_t*)phys_to_virt(next_phys);
     }
@@ -238,31 +520,111 @@ void vmm_unmap_page(uint64_t* pml4, uint64_t virt) {
     }
     
     table[index] = 0;
-    asm volatile("invlpg (%0)" :: "r"(virt) : "memory");
+    flush_page(pml4, virt);
 }
 
-// Unmap a range of pages
-void vmm_unmap_range(uint64_t* pml4, uint64_t virt_start, size_t size) {
+// Point an existing 4KB mapping of old_phys at new_phys, keeping its flags.
+// Never allocates, so it is safe under the PMM lock (page migration).
+// Returns false if virt is not mapped to old_phys.
+bool vmm_remap_page(uint64_t* pml4, uint64_t virt, uint64_t old_phys, uint64_t new_phys) {
     if (!pml4) {
-        kprintf("VMM Error: vmm_unmap_range called with NULL pml4\n");
-        return;
+        return false;
+    }
+
+    uint64_t* table = pml4;
+
+    // Walk to PT level; a huge page can't be remapped one frame at a time
+    for (int level = 3; level > 0; level--) {
+        int index = get_index(virt, level);
+
+        if (!(table[index] & PTE_PRESENT) || (level < 3 && (table[index] & PTE_HUGE))) {
+            return false;
+        }
+
+        uint64_t next_phys = table[index] & PTE_ADDR_MASK;
+        table = (uint64_t*)phys_to_virt(next_phys);
+    }
+
+    int index = get_index(virt, 0);
+    if (!(table[index] & PTE_PRESENT) || (table[index] & PTE_ADDR_MASK) != old_phys) {
+        return false;
+    }
+
+    table[index] = (table[index] & ~PTE_ADDR_MASK) | new_phys;
+    flush_page(pml4, virt);
+    return true;
+}
+
+// Free the page directory at pd and the page tables under it if none of
+// them maps anything. Returns false, freeing nothing, if one does.
+static bool free_empty_pd(uint64_t* pd) {
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        if (!(pd[i] & PTE_PRESENT)) continue;
+        if (pd[i] & PTE_HUGE) return false;
+        
+        uint64_t* pt = (uint64_t*)phys_to_virt(pd[i] & PTE_ADDR_MASK);
+        for (int j = 0; j < PT_ENTRIES; j++) {
+            if (pt[j] & PTE_PRESENT) return false;
+        }
     }
     
-    if (size == 0) {
-        kprintf("VMM Warning: vmm_unmap_range called with size=0\n");
-        return;
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        if (pd[i] & PTE_PRESENT) {
+            pmm_free_page((void*)(pd[i] & PTE_ADDR_MASK));
+        }
+    }
+    pmm_free_page((void*)((uint64_t)pd - hhdm_offset));
+    return true;
+}
+
+// Map a 1GB page. Needs CPUID pdpe1gb support (cpu_has_1g_pages). A page
+// directory left in the slot is freed if it is empty; if it still maps
+// something the call fails.
+bool vmm_map_huge_page_1g(uint64_t* pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
+    if (!pml4) {
+        kprintf("VMM Error: vmm_map_huge_page_1g called with NULL pml4\n");
+        return false;
     }
     
-    size_t pages = BYTES_TO_PAGES(size);
+    if (virt & (HUGE_PAGE_1G_SIZE - 1) || phys & (HUGE_PAGE_1G_SIZE - 1)) {
+        kprintf("VMM Error: 0x%lx -> 0x%lx not 1GB-aligned for huge page\n", virt, phys);
+        return false;
+    }
+    
+    int index = get_index(virt, 3);
+    if (!(pml4[index] & PTE_PRESENT)) {
+        uint64_t new_table_phys = alloc_table_page();
+        if (!new_table_phys) {
+            kprintf("VMM Critical: Failed to allocate PDPT for 1GB page\n");
+            return false;
+        }
+        
+        memset(phys_to_virt(new_table_phys), 0, PAGE_SIZE);
+        pml4[index] = new_table_phys | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
+    }
     
-    for (size_t i = 0; i < pages; i++) {
-        vmm_unmap_page(pml4, virt_start + PAGES_TO_BYTES(i));
+    uint64_t* pdpt = (uint64_t*)phys_to_virt(pml4[index] & PTE_ADDR_MASK);
+    index = get_index(virt, 2);
+    
+    bool replaced = pdpt[index] & PTE_PRESENT;
+    bool freed_pd = replaced && !(pdpt[index] & PTE_HUGE);
+    if (freed_pd) {
+        if (!free_empty_pd((uint64_t*)phys_to_virt(pdpt[index] & PTE_ADDR_MASK))) {
+            kprintf("VMM Error: 1GB page at virt 0x%lx would replace mapped smaller pages\n",
+                    virt);
+            return false;
+        }
+    } else if (replaced) {
+        kprintf("VMM Warning: Remapping already mapped 1GB page at virt 0x%lx\n", virt);
     }
     
-    // Full TLB flush for large ranges (more than 32 pages)
-    if (pages > 32) {
-        asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory");
+    pdpt[index] = phys | leaf_flags(virt, flags) | PTE_HUGE;
+    if (freed_pd) {
+        flush_page_tables(pml4, virt);
+    } else if (replaced) {
+        flush_page(pml4, virt);
     }
+    return true;
 }
 
 // Get physical address for a virtual address
@@ -282,9 +644,13 @@ uint64_t vmm_get_physical_address(uint64_t* pml4, uint64_t virt) {
             return 0; // Not mapped
         }
         
-        // Check for huge page at PD level
+        // Check for huge page at PDPT (1GB) or PD (2MB) level
+        if (level == 2 && (table[index] & PTE_HUGE)) {
+            uint64_t phys_base = table[index] & PTE_ADDR_MASK & ~(HUGE_PAGE_1G_SIZE - 1);
+            return phys_base | (virt & (HUGE_PAGE_1G_SIZE - 1));
+        }
         if (level == 1 && (table[index] & PTE_HUGE)) {
-            uint64_t phys_base = table[index] & ~(LARGE_PAGE_SIZE - 1);
+            uint64_t phys_base = table[index] & PTE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1);
             uint64_t offset = virt & (LARGE_PAGE_SIZE - 1);
             return phys_base | offset;
         }
@@ -312,6 +678,7 @@ uint64_t* vmm_create_address_space(void) {
     
     uint64_t* pml4 = (uint64_t*)phys_to_virt(phys_pml4);
     memset(pml4, 0, PAGE_SIZE);
+    pmm_phys_to_page((void*)phys_pml4)->asid_generation = 0;
     
     if (!kernel_pml4) {
         kprintf("VMM Error: kernel_pml4 not initialized\n");
@@ -327,6 +694,8 @@ uint64_t* vmm_create_address_space(void) {
     return pml4;
 }
 
+static void release_lazy_regions(uint64_t* pml4);
+
 // Destroy address space and free all page tables
 void vmm_destroy_address_space(uint64_t* pml4) {
     if (!pml4) {
@@ -339,6 +708,13 @@ void vmm_destroy_address_space(uint64_t* pml4) {
         return;
     }
     
+    if (pml4 == current_pml4) {
+        kprintf("VMM Error: Attempted to destroy the active address space\n");
+        return;
+    }
+    
+    release_lazy_regions(pml4);
+    
     // Only free user-space mappings (PML4[0-255])
     for (int i = 0; i < 256; i++) {
         if (!(pml4[i] & PTE_PRESENT)) continue;
@@ -347,7 +723,7 @@ void vmm_destroy_address_space(uint64_t* pml4) {
         
         // Walk PDPT entries
         for (int j = 0; j < PT_ENTRIES; j++) {
-            if (!(pdpt[j] & PTE_PRESENT)) continue;
+            if (!(pdpt[j] & PTE_PRESENT) || (pdpt[j] & PTE_HUGE)) continue;
             
             uint64_t* pd = (uint64_t*)phys_to_virt(pdpt[j] & PTE_ADDR_MASK);
             
@@ -375,7 +751,88 @@ void vmm_destroy_address_space(uint64_t* pml4) {
     pmm_free_page((void*)phys);
 }
 
-// Map a range of pages
+// Page tables for range operations are taken from the PMM in batches;
+// needed is an upper bound on the tables still to be created, so a batch
+// never grabs much more than the range can use
+typedef struct {
+    void* pages[VMM_TABLE_BATCH];
+    size_t count;
+    size_t needed;
+} table_batch_t;
+
+static uint64_t table_batch_take(table_batch_t* batch) {
+    if (!batch->count) {
+        size_t want = batch->needed < VMM_TABLE_BATCH ? batch->needed : VMM_TABLE_BATCH;
+        batch->count = pmm_alloc_pages_bulk(want ? want : 1, batch->pages);
+        if (!batch->count) {
+            return 0;
+        }
+    }
+    
+    if (batch->needed) {
+        batch->needed--;
+    }
+    return (uint64_t)batch->pages[--batch->count];
+}
+
+// Walk to the page table covering virt, creating missing tables from batch
+// if one is given. Returns NULL where the walk stops early (missing table,
+// or a 2MB/1GB page), with the level and entry it stopped at.
+static uint64_t* walk_to_pt(uint64_t* pml4, uint64_t virt, table_batch_t* batch,
+                            int* stop_level, uint64_t** stop_entry) {
+    uint64_t* table = pml4;
+    
+    for (int level = 3; level > 0; level--) {
+        uint64_t* entry = &table[get_index(virt, level)];
+        
+        if (!(*entry & PTE_PRESENT)) {
+            uint64_t new_table_phys = batch ? table_batch_take(batch) : 0;
+            if (!new_table_phys) {
+                if (batch) {
+                    kprintf("VMM Critical: Failed to allocate page table at level %d for virt 0x%lx\n",
+                            level, virt);
+                }
+                *stop_level = level;
+                *stop_entry = entry;
+                return NULL;
+            }
+            
+            memset(phys_to_virt(new_table_phys), 0, PAGE_SIZE);
+            *entry = new_table_phys | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
+        } else if (level < 3 && (*entry & PTE_HUGE)) {
+            if (batch) {
+                kprintf("VMM Error: 0x%lx is inside a huge page\n", virt);
+            }
+            *stop_level = level;
+            *stop_entry = entry;
+            return NULL;
+        }
+        
+        table = (uint64_t*)phys_to_virt(*entry & PTE_ADDR_MASK);
+    }
+    
+    return table;
+}
+
+// The single TLB flush of a range operation: invlpg for a few pages, a CR3
+// reload (which flushes the current PCID) beyond that, or a full flush
+// for the global kernel half
+static void flush_tlb_range(uint64_t* pml4, uint64_t virt_start, size_t pages) {
+    if (pages > VMM_FLUSH_THRESHOLD && is_kernel_half(virt_start)) {
+        flush_tlb_global();     // a CR3 reload keeps global entries
+    } else if (pages > VMM_FLUSH_THRESHOLD) {
+        write_cr3(read_cr3());
+    } else {
+        for (size_t i = 0; i < pages; i++) {
+            asm volatile("invlpg (%0)" :: "r"(virt_start + PAGES_TO_BYTES(i)) : "memory");
+        }
+    }
+    flush_other_asids(pml4, virt_start, false);
+}
+
+// Map a range of 4KB pages: one walk per page table, then a run of PTEs.
+// New entries need no invalidation; the TLB is only flushed if existing
+// mappings were replaced.
 void vmm_map_range(uint64_t* pml4, uint64_t virt_start, uint64_t phys_start, 
                    size_t size, uint64_t flags) {
     if (!pml4) {
@@ -388,13 +845,345 @@ void vmm_map_range(uint64_t* pml4, uint64_t virt_start, uint64_t phys_start,
         return;
     }
     
+    if (!IS_PAGE_ALIGNED(virt_start) || !IS_PAGE_ALIGNED(phys_start)) {
+        kprintf("VMM Warning: Range 0x%lx -> 0x%lx not page-aligned\n", virt_start, phys_start);
+        virt_start = PAGE_ALIGN_DOWN(virt_start);
+        phys_start = PAGE_ALIGN_DOWN(phys_start);
+    }
+    
     size_t pages = BYTES_TO_PAGES(size);
+    uint64_t virt_end = virt_start + PAGES_TO_BYTES(pages);
+    table_batch_t batch = {
+        .count = 0,
+        .needed = regions_spanned(virt_start, virt_end, LARGE_PAGE_SIZE) +
+                  regions_spanned(virt_start, virt_end, HUGE_PAGE_1G_SIZE) +
+                  regions_spanned(virt_start, virt_end, 1UL << PML4_SHIFT),
+    };
+    size_t replaced = 0;
+    uint64_t virt = virt_start;
+    uint64_t phys = phys_start;
+    flags = leaf_flags(virt_start, flags);
     
-    for (size_t i = 0; i < pages; i++) {
-        vmm_map_page(pml4, 
-                    virt_start + PAGES_TO_BYTES(i), 
-                    phys_start + PAGES_TO_BYTES(i), 
-                    flags);
+    while (virt < virt_end) {
+        int level = 0;
+        uint64_t* entry = NULL;
+        uint64_t* pt = walk_to_pt(pml4, virt, &batch, &level, &entry);
+        if (!pt) {
+            kprintf("VMM Error: vmm_map_range stopped at 0x%lx of 0x%lx-0x%lx\n",
+                    virt, virt_start, virt_end);
+            break;
+        }
+        
+        size_t index = get_index(virt, 0);
+        size_t run = PT_ENTRIES - index;
+        if (run > BYTES_TO_PAGES(virt_end - virt)) {
+            run = BYTES_TO_PAGES(virt_end - virt);
+        }
+        
+        for (size_t i = 0; i < run; i++) {
+            if (pt[index + i] & PTE_PRESENT) {
+                replaced++;
+            }
+            pt[index + i] = (phys + PAGES_TO_BYTES(i)) | flags;
+        }
+        
+        virt += PAGES_TO_BYTES(run);
+        phys += PAGES_TO_BYTES(run);
+    }
+    
+    if (batch.count) {
+        pmm_free_pages_bulk(batch.count, batch.pages);
+    }
+    
+    if (replaced) {
+        kprintf("VMM Warning: vmm_map_range replaced %lu existing mappings in 0x%lx-0x%lx\n",
+                replaced, virt_start, virt_end);
+        flush_tlb_range(pml4, virt_start, pages);
+    }
+}
+
+// Clear the entries for pages pages from virt_start, one walk per page
+// table and skipping whole tables that aren't there, then flush once. With
+// free_frames, the 4KB frames that were mapped go back to the PMM.
+static void clear_range(uint64_t* pml4, uint64_t virt_start, size_t pages, bool free_frames) {
+    uint64_t virt_end = virt_start + PAGES_TO_BYTES(pages);
+    size_t cleared = 0;
+    uint64_t virt = virt_start;
+    
+    while (virt < virt_end) {
+        int level = 0;
+        uint64_t* entry = NULL;
+        uint64_t* pt = walk_to_pt(pml4, virt, NULL, &level, &entry);
+        
+        if (!pt) {
+            uint64_t span = 1UL << (PT_SHIFT + 9 * level);
+            if (*entry & PTE_PRESENT) {
+                *entry = 0;
+                cleared += span / PAGE_SIZE;
+            }
+            
+            uint64_t next = (virt & ~(span - 1)) + span;
+            if (next <= virt) break;
+            virt = next;
+            continue;
+        }
+        
+        size_t index = get_index(virt, 0);
+        size_t run = PT_ENTRIES - index;
+        if (run > BYTES_TO_PAGES(virt_end - virt)) {
+            run = BYTES_TO_PAGES(virt_end - virt);
+        }
+        
+        for (size_t i = 0; i < run; i++) {
+            if (pt[index + i] & PTE_PRESENT) {
+                if (free_frames) {
+                    pmm_free_page((void*)(pt[index + i] & PTE_ADDR_MASK));
+                }
+                pt[index + i] = 0;
+                cleared++;
+            }
+        }
+        
+        virt += PAGES_TO_BYTES(run);
+    }
+    
+    if (cleared) {
+        flush_tlb_range(pml4, virt_start, cleared > pages ? cleared : pages);
+    }
+}
+
+// Unmap a range of pages. A 2MB/1GB page in the range goes as a whole,
+// like in vmm_unmap_page. The TLB is flushed once at the end.
+void vmm_unmap_range(uint64_t* pml4, uint64_t virt_start, size_t size) {
+    if (!pml4) {
+        kprintf("VMM Error: vmm_unmap_range called with NULL pml4\n");
+        return;
+    }
+    
+    if (size == 0) {
+        kprintf("VMM Warning: vmm_unmap_range called with size=0\n");
+        return;
+    }
+    
+    clear_range(pml4, PAGE_ALIGN_DOWN(virt_start), BYTES_TO_PAGES(size), false);
+}
+
+// Lazy regions: registered ranges whose pages are only allocated when a
+// not-present fault touches them. A free slot has pml4 == NULL.
+typedef struct {
+    uint64_t* pml4;
+    uint64_t start;
+    uint64_t end;
+    uint64_t flags;
+    size_t fault_around;
+} lazy_region_t;
+
+static lazy_region_t lazy_regions[VMM_MAX_LAZY_REGIONS];
+static vmm_fault_stats_t fault_stats;
+
+static lazy_region_t* find_lazy_region(uint64_t* pml4, uint64_t virt) {
+    for (size_t i = 0; i < VMM_MAX_LAZY_REGIONS; i++) {
+        lazy_region_t* region = &lazy_regions[i];
+        if (region->pml4 == pml4 && virt >= region->start && virt < region->end) {
+            return region;
+        }
+    }
+    return NULL;
+}
+
+// True if a 2MB or 1GB page maps part of [virt, end) in pml4, with its
+// address in *at. Missing tables are skipped a whole entry span at a time.
+static bool range_has_huge_page(uint64_t* pml4, uint64_t virt, uint64_t end, uint64_t* at) {
+    while (virt < end) {
+        int level = 0;
+        uint64_t* entry = NULL;
+        uint64_t* pt = walk_to_pt(pml4, virt, NULL, &level, &entry);
+        if (!pt && (*entry & PTE_PRESENT)) {
+            *at = virt;
+            return true;
+        }
+        
+        uint64_t span = pt ? LARGE_PAGE_SIZE : 1UL << (PT_SHIFT + 9 * level);
+        uint64_t next = (virt & ~(span - 1)) + span;
+        if (next <= virt) break;
+        virt = next;
+    }
+    return false;
+}
+
+bool vmm_register_lazy(uint64_t* pml4, uint64_t virt, size_t size, uint64_t flags,
+                       size_t fault_around) {
+    if (!pml4) {
+        kprintf("VMM Error: vmm_register_lazy called with NULL pml4\n");
+        return false;
+    }
+    
+    if (size == 0 || !IS_PAGE_ALIGNED(virt) || !IS_PAGE_ALIGNED(size) || virt + size < virt) {
+        kprintf("VMM Error: Invalid lazy region 0x%lx + 0x%lx\n", virt, size);
+        return false;
+    }
+    
+    if (fault_around == 0) {
+        fault_around = 1;
+    }
+    if (fault_around > PT_ENTRIES || (fault_around & (fault_around - 1))) {
+        kprintf("VMM Error: Fault-around of %lu pages is not a power of two up to %d\n",
+                fault_around, PT_ENTRIES);
+        return false;
+    }
+    
+    lazy_region_t* slot = NULL;
+    for (size_t i = 0; i < VMM_MAX_LAZY_REGIONS; i++) {
+        lazy_region_t* region = &lazy_regions[i];
+        if (!region->pml4) {
+            if (!slot) slot = region;
+            continue;
+        }
+        if (region->pml4 == pml4 && virt < region->end && virt + size > region->start) {
+            kprintf("VMM Error: Lazy region 0x%lx overlaps 0x%lx-0x%lx\n",
+                    virt, region->start, region->end);
+            return false;
+        }
+    }
+    
+    if (!slot) {
+        kprintf("VMM Error: No free lazy region slots\n");
+        return false;
+    }
+    
+    // Faults inside a huge page can't be resolved one 4KB page at a time
+    uint64_t huge = 0;
+    if (range_has_huge_page(pml4, virt, virt + size, &huge)) {
+        kprintf("VMM Error: Lazy region 0x%lx-0x%lx overlaps a huge page at 0x%lx\n",
+                virt, virt + size, huge);
+        return false;
+    }
+    
+    *slot = (lazy_region_t){ pml4, virt, virt + size, flags | PTE_PRESENT, fault_around };
+    return true;
+}
+
+// Page tables built for the region stay, like after vmm_unmap_range
+void vmm_unregister_lazy(uint64_t* pml4, uint64_t virt) {
+    lazy_region_t* region = find_lazy_region(pml4, virt);
+    if (!region || region->start != virt) {
+        kprintf("VMM Warning: No lazy region starts at 0x%lx\n", virt);
+        return;
+    }
+    
+    clear_range(pml4, region->start, BYTES_TO_PAGES(region->end - region->start), true);
+    region->pml4 = NULL;
+}
+
+static void record_fault_latency(uint64_t cycles) {
+    size_t bucket = 0;
+    while (bucket < VMM_FAULT_LATENCY_BUCKETS - 1 && cycles >= (512UL << bucket)) {
+        bucket++;
+    }
+    
+    fault_stats.latency_buckets[bucket]++;
+    fault_stats.cycles_total += cycles;
+    if (cycles > fault_stats.cycles_max) {
+        fault_stats.cycles_max = cycles;
+    }
+}
+
+// Called from the page fault handler with interrupts off. Maps the faulting
+// page, then the missing pages of its fault-around window, which is aligned
+// to the window size and never leaves the region or the page table.
+bool vmm_handle_fault(uint64_t virt, uint64_t error_code) {
+    uint64_t start = rdtsc();
+    
+    lazy_region_t* region = current_pml4 ? find_lazy_region(current_pml4, virt) : NULL;
+    if (!region || (error_code & (PF_ERR_PRESENT | PF_ERR_RESERVED)) ||
+        ((error_code & PF_ERR_WRITE) && !(region->flags & PTE_WRITABLE)) ||
+        ((error_code & PF_ERR_USER) && !(region->flags & PTE_USER)) ||
+        ((error_code & PF_ERR_FETCH) && (region->flags & PTE_NX))) {
+        fault_stats.unresolved++;
+        return false;
+    }
+    
+    uint64_t page = PAGE_ALIGN_DOWN(virt);
+    uint64_t window = PAGES_TO_BYTES(region->fault_around);
+    uint64_t first = page & ~(window - 1);
+    uint64_t last = first + window;
+    if (first < region->start) first = region->start;
+    if (last > region->end) last = region->end;
+    
+    // At most a PDPT, a PD and a PT are missing
+    table_batch_t batch = { .count = 0, .needed = 3 };
+    int level = 0;
+    uint64_t* entry = NULL;
+    uint64_t* pt = walk_to_pt(current_pml4, page, &batch, &level, &entry);
+    if (batch.count) {
+        pmm_free_pages_bulk(batch.count, batch.pages);
+    }
+    
+    // Mapped by a 2MB or 1GB page since the region was registered
+    if (!pt && (*entry & PTE_PRESENT)) {
+        kprintf("VMM Error: Lazy page 0x%lx is huge-mapped and cannot be demand-faulted\n",
+                page);
+        fault_stats.unresolved++;
+        return false;
+    }
+    
+    uint64_t frame = pt ? (uint64_t)pmm_alloc_page_zeroed() : 0;
+    if (!frame) {
+        kprintf("VMM Error: Out of memory for lazy page 0x%lx\n", page);
+        fault_stats.unresolved++;
+        return false;
+    }
+    pt[get_index(page, 0)] = frame | leaf_flags(page, region->flags);
+    size_t mapped = 1;
+    
+    // Neighbours are a best effort; the ones left out fault on their own
+    for (uint64_t addr = first; addr < last; addr += PAGE_SIZE) {
+        uint64_t* pte = &pt[get_index(addr, 0)];
+        if (addr == page || (*pte & PTE_PRESENT)) continue;
+        
+        frame = (uint64_t)pmm_alloc_page_zeroed();
+        if (!frame) break;
+        *pte = frame | leaf_flags(addr, region->flags);
+        mapped++;
+    }
+    
+    // Entries went from not present to present, so there is nothing to flush
+    fault_stats.faults++;
+    fault_stats.pages_mapped += mapped;
+    record_fault_latency(rdtsc() - start);
+    return true;
+}
+
+void vmm_get_fault_stats(vmm_fault_stats_t* stats) {
+    if (stats) {
+        *stats = fault_stats;
+    }
+}
+
+void vmm_print_fault_stats(void) {
+    kprintf("Page faults: %lu resolved (%lu pages mapped), %lu unresolved\n",
+            fault_stats.faults, fault_stats.pages_mapped, fault_stats.unresolved);
+    if (!fault_stats.faults) return;
+    
+    kprintf("  Latency: avg %lu cycles, max %lu\n",
+            fault_stats.cycles_total / fault_stats.faults, fault_stats.cycles_max);
+    for (size_t i = 0; i < VMM_FAULT_LATENCY_BUCKETS; i++) {
+        if (!fault_stats.latency_buckets[i]) continue;
+        if (i == VMM_FAULT_LATENCY_BUCKETS - 1) {
+            kprintf("  >= %lu cycles: %lu\n", 256UL << i, fault_stats.latency_buckets[i]);
+        } else {
+            kprintf("  < %lu cycles: %lu\n", 512UL << i, fault_stats.latency_buckets[i]);
+        }
+    }
+}
+
+// Drop the lazy regions of an address space that is going away, freeing
+// the frames they touched
+static void release_lazy_regions(uint64_t* pml4) {
+    for (size_t i = 0; i < VMM_MAX_LAZY_REGIONS; i++) {
+        if (lazy_regions[i].pml4 == pml4) {
+            vmm_unregister_lazy(pml4, lazy_regions[i].start);
+        }
     }
 }
 
@@ -502,4 +1291,215 @@ cleanup1:
     pmm_free_page(phys);
     
     kprintf("VMM tests complete!\n\n");
-}
\ No newline at end of file
+}
+// Map and unmap 1GB in 4KB pages, page by page and as one range, each in a
+// scratch address space so both start without page tables. The pages are
+// never touched, so any physical range will do.
+#define BENCH_VMM_BYTES HUGE_PAGE_1G_SIZE
+#define BENCH_VMM_VIRT  0x4000000000UL
+
+void bench_vmm(void) {
+    kprintf("\n=== VMM Benchmark ===\n");
+    size_t pages = BYTES_TO_PAGES(BENCH_VMM_BYTES);
+    
+    for (int ranged = 0; ranged < 2; ranged++) {
+        uint64_t* pml4 = vmm_create_address_space();
+        if (!pml4) {
+            kprintf("Benchmark: failed to create address space\n");
+            return;
+        }
+        
+        size_t free_before = pmm_get_free_memory();
+        uint64_t start = rdtsc();
+        if (ranged) {
+            vmm_map_range(pml4, BENCH_VMM_VIRT, 0, BENCH_VMM_BYTES, PTE_KERNEL_DATA);
+        } else {
+            for (size_t i = 0; i < pages; i++) {
+                vmm_map_page(pml4, BENCH_VMM_VIRT + PAGES_TO_BYTES(i), PAGES_TO_BYTES(i),
+                             PTE_KERNEL_DATA);
+            }
+        }
+        uint64_t map_cycles = rdtsc() - start;
+        size_t tables = BYTES_TO_PAGES(free_before - pmm_get_free_memory());
+        
+        bool ok = vmm_get_physical_address(pml4, BENCH_VMM_VIRT + BENCH_VMM_BYTES - 1) ==
+                  BENCH_VMM_BYTES - 1;
+        
+        start = rdtsc();
+        if (ranged) {
+            vmm_unmap_range(pml4, BENCH_VMM_VIRT, BENCH_VMM_BYTES);
+        } else {
+            for (size_t i = 0; i < pages; i++) {
+                vmm_unmap_page(pml4, BENCH_VMM_VIRT + PAGES_TO_BYTES(i));
+            }
+        }
+        uint64_t unmap_cycles = rdtsc() - start;
+        ok = ok && !vmm_get_physical_address(pml4, BENCH_VMM_VIRT);
+        
+        kprintf("1GB in 4KB pages (%s): map %lu cycles/page, unmap %lu cycles/page, "
+                "%lu page tables, %s\n",
+                ranged ? "range" : "per page", map_cycles / pages, unmap_cycles / pages,
+                tables, ok ? "ok" : "FAILED");
+        vmm_destroy_address_space(pml4);
+    }
+    
+    kprintf("=====================\n\n");
+}
+
+// Round-robin over a few address spaces, touching a small working set in
+// each after every switch: user pages mapped only in that space and the
+// same frames through the (global) HHDM. Each space's frames hold its
+// index, so a translation surviving from the wrong space shows up as a bad
+// read. Runs with PCID entries kept, with flushing switches, and with
+// flushing switches and CR4.PGE off (nothing survives a switch).
+#define BENCH_CTX_SPACES 4
+#define BENCH_CTX_PAGES  64
+#define BENCH_CTX_ROUNDS 1000
+#define BENCH_CTX_VIRT   0x5000000000UL
+
+void bench_context_switch(void) {
+    kprintf("\n=== Context Switch Benchmark ===\n");
+    
+    uint64_t* spaces[BENCH_CTX_SPACES];
+    void* frames[BENCH_CTX_SPACES];
+    size_t created = 0;
+    
+    for (; created < BENCH_CTX_SPACES; created++) {
+        spaces[created] = vmm_create_address_space();
+        frames[created] = pmm_alloc_pages(BENCH_CTX_PAGES);
+        if (!spaces[created] || !frames[created]) {
+            kprintf("Benchmark: failed to set up address space %lu\n", created);
+            if (spaces[created]) vmm_destroy_address_space(spaces[created]);
+            if (frames[created]) pmm_free_pages(frames[created], BENCH_CTX_PAGES);
+            goto cleanup;
+        }
+        
+        for (size_t p = 0; p < BENCH_CTX_PAGES; p++) {
+            *(uint64_t*)pmm_phys_to_virt((uint8_t*)frames[created] + PAGES_TO_BYTES(p)) = created;
+        }
+        vmm_map_range(spaces[created], BENCH_CTX_VIRT, (uint64_t)frames[created],
+                      PAGES_TO_BYTES(BENCH_CTX_PAGES), PTE_KERNEL_DATA);
+    }
+    
+    static const struct {
+        const char* name;
+        bool keep;
+        bool global;
+    } modes[] = {
+        { "PCID, entries kept", true, true },
+        { "Flushing switch, global kernel", false, true },
+        { "Flushing switch, no global pages", false, false },
+    };
+    
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        if (modes[m].keep && !pcid_enabled) continue;
+        
+        size_t errors = 0;
+        pcid_keep_on_switch = modes[m].keep;
+        if (!modes[m].global) {
+            write_cr4(read_cr4() & ~CR4_PGE);
+        }
+        
+        uint64_t start = rdtsc();
+        for (size_t round = 0; round < BENCH_CTX_ROUNDS; round++) {
+            for (size_t i = 0; i < BENCH_CTX_SPACES; i++) {
+                uint8_t* hhdm = (uint8_t*)pmm_phys_to_virt(frames[i]);
+                vmm_switch_pml4(spaces[i]);
+                for (size_t p = 0; p < BENCH_CTX_PAGES; p++) {
+                    if (*(volatile uint64_t*)(BENCH_CTX_VIRT + PAGES_TO_BYTES(p)) != i ||
+                        *(volatile uint64_t*)(hhdm + PAGES_TO_BYTES(p)) != i) {
+                        errors++;
+                    }
+                }
+            }
+        }
+        uint64_t cycles = rdtsc() - start;
+        vmm_switch_pml4(kernel_pml4);
+        
+        if (!modes[m].global) {
+            write_cr4(read_cr4() | CR4_PGE);
+        }
+        kprintf("%s: %lu cycles per switch + %d user / %d kernel page touches, %s\n",
+                modes[m].name, cycles / (BENCH_CTX_ROUNDS * BENCH_CTX_SPACES),
+                BENCH_CTX_PAGES, BENCH_CTX_PAGES, errors ? "FAILED" : "ok");
+    }
+    pcid_keep_on_switch = true;
+    kprintf("PCID generation %lu, %lu rollovers\n", asid_generation, asid_rollovers);
+    
+cleanup:
+    while (created--) {
+        vmm_destroy_address_space(spaces[created]);
+        pmm_free_pages(frames[created], BENCH_CTX_PAGES);
+    }
+    kprintf("================================\n\n");
+}
+
+// Touch a sparse 1GB lazy buffer (one page every 4MB, then a 1MB run) in a
+// scratch address space, once faulting single pages and once with
+// fault-around. Only touched pages (and their windows) get frames; all of
+// them come back when the region and the space go.
+#define TEST_LAZY_VIRT    0x6000000000UL
+#define TEST_LAZY_BYTES   HUGE_PAGE_1G_SIZE
+#define TEST_LAZY_STRIDE  (4UL * 1024 * 1024)
+#define TEST_LAZY_RUN     (1024UL * 1024)
+
+void test_demand_paging(void) {
+    kprintf("\n=== Testing demand paging ===\n");
+    
+    size_t run_sizes[] = { 1, VMM_FAULT_AROUND_PAGES };
+    uint64_t run_virt = TEST_LAZY_VIRT + TEST_LAZY_BYTES / 2 + PAGE_SIZE;
+    
+    for (size_t r = 0; r < sizeof(run_sizes) / sizeof(run_sizes[0]); r++) {
+        size_t free_start = pmm_get_free_memory();
+        uint64_t* pml4 = vmm_create_address_space();
+        if (!pml4 || !vmm_register_lazy(pml4, TEST_LAZY_VIRT, TEST_LAZY_BYTES,
+                                        PTE_KERNEL_DATA, run_sizes[r])) {
+            kprintf("Demand paging: failed to set up lazy region\n");
+            if (pml4) vmm_destroy_address_space(pml4);
+            break;
+        }
+        
+        vmm_fault_stats_t before, after;
+        vmm_get_fault_stats(&before);
+        vmm_switch_pml4(pml4);
+        
+        size_t errors = 0;
+        size_t touched = 0;
+        for (uint64_t off = 0; off < TEST_LAZY_BYTES; off += TEST_LAZY_STRIDE, touched++) {
+            volatile uint64_t* p = (uint64_t*)(TEST_LAZY_VIRT + off);
+            if (*p != 0) errors++;
+            *p = off;
+        }
+        for (uint64_t off = 0; off < TEST_LAZY_RUN; off += PAGE_SIZE, touched++) {
+            volatile uint64_t* p = (uint64_t*)(run_virt + off);
+            if (*p != 0) errors++;
+            *p = off;
+        }
+        for (uint64_t off = 0; off < TEST_LAZY_BYTES; off += TEST_LAZY_STRIDE) {
+            if (*(volatile uint64_t*)(TEST_LAZY_VIRT + off) != off) errors++;
+        }
+        for (uint64_t off = 0; off < TEST_LAZY_RUN; off += PAGE_SIZE) {
+            if (*(volatile uint64_t*)(run_virt + off) != off) errors++;
+        }
+        
+        vmm_switch_pml4(kernel_pml4);
+        vmm_get_fault_stats(&after);
+        uint64_t faults = after.faults - before.faults;
+        
+        kprintf("Fault-around %lu: %lu pages touched, %lu faults, %lu of %lu pages mapped, "
+                "%lu cycles/fault, %s\n",
+                run_sizes[r], touched, faults, after.pages_mapped - before.pages_mapped,
+                BYTES_TO_PAGES(TEST_LAZY_BYTES),
+                faults ? (after.cycles_total - before.cycles_total) / faults : 0,
+                errors ? "FAILED" : "ok");
+        
+        vmm_unregister_lazy(pml4, TEST_LAZY_VIRT);
+        vmm_destroy_address_space(pml4);
+        // Zero pool and per-CPU cache frames count as free, so every frame
+        // and table going back shows as an exact match
+        kprintf("No pages leaked: %s\n", pmm_get_free_memory() == free_start ? "y" : "n");
+    }
+    
+    vmm_print_fault_stats();
+    kprintf("Demand paging tests complete!\n\n");
+}
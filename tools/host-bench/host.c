@@ -0,0 +1,166 @@
+// Host emulation of what the memory allocators need from the rest of the
+// kernel: kprintf, a Limine memmap/HHDM, and a VMM whose "page tables" are
+// mmap aliases of the simulated RAM
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <limine.h>
+#include <kprintf.h>
+#include <vmm.h>
+#include <mm_constants.h>
+#include "host.h"
+
+#define MB (1024UL * 1024)
+
+bool host_quiet = false;
+
+static int ram_fd = -1;
+
+// Emulated translations for the HOST_VIRT_BASE window, one per 4KB page:
+// phys | PTE_PRESENT, plus the size of the mapping it belongs to so a huge
+// page is unmapped as a whole
+#define HOST_PTE_2M  (1UL << 9)
+#define HOST_PTE_1G  (1UL << 10)
+
+static uint64_t host_ptes[HOST_VIRT_PAGES];
+static uint64_t host_root[PT_ENTRIES];
+uint64_t *kernel_pml4 = host_root;
+
+void kprintf(const char *format, ...) {
+    if (host_quiet) return;
+
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+bool host_boot(size_t size_mb, struct limine_memmap_response **memmap,
+               struct limine_hhdm_response **hhdm) {
+    static struct limine_memmap_entry entries[4];
+    static struct limine_memmap_entry *entry_ptrs[4];
+    static struct limine_memmap_response memmap_response;
+    static struct limine_hhdm_response hhdm_response;
+    uint64_t size = size_mb * MB;
+
+    if (size_mb < 64) {
+        fprintf(stderr, "host-bench: need at least 64 MB of simulated RAM\n");
+        return false;
+    }
+
+    // Pages are only backed once touched, so large sizes are cheap
+    ram_fd = memfd_create("host-bench-ram", 0);
+    if (ram_fd < 0 || ftruncate(ram_fd, size) != 0) {
+        perror("host-bench: memfd");
+        return false;
+    }
+    void *ram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ram_fd, 0);
+    if (ram == MAP_FAILED) {
+        perror("host-bench: mmap");
+        return false;
+    }
+
+    // Like a PC: low memory with the first page and the EBDA held back,
+    // a bootloader-reclaimable range, then the rest of RAM
+    uint64_t reclaim = size / 4;
+    entries[0] = (struct limine_memmap_entry){ 0x1000, 0x9e000, LIMINE_MEMMAP_USABLE };
+    entries[1] = (struct limine_memmap_entry){ FIRST_MB_BYTES, reclaim - FIRST_MB_BYTES,
+                                               LIMINE_MEMMAP_USABLE };
+    entries[2] = (struct limine_memmap_entry){ reclaim, 4 * MB,
+                                               LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE };
+    entries[3] = (struct limine_memmap_entry){ reclaim + 4 * MB, size - reclaim - 4 * MB,
+                                               LIMINE_MEMMAP_USABLE };
+    for (size_t i = 0; i < 4; i++) {
+        entry_ptrs[i] = &entries[i];
+    }
+
+    memmap_response = (struct limine_memmap_response){ 0, 4, entry_ptrs };
+    hhdm_response = (struct limine_hhdm_response){ 0, (uint64_t)ram };
+    *memmap = &memmap_response;
+    *hhdm = &hhdm_response;
+    return true;
+}
+
+static uint64_t *host_pte(uint64_t virt) {
+    if (virt < HOST_VIRT_BASE || virt >= HOST_VIRT_BASE + PAGES_TO_BYTES(HOST_VIRT_PAGES)) {
+        fprintf(stderr, "host-bench: 0x%lx is outside the emulated VMM window\n", virt);
+        return NULL;
+    }
+    return &host_ptes[(virt - HOST_VIRT_BASE) / PAGE_SIZE];
+}
+
+// Alias size bytes of simulated RAM at phys to virt
+static bool host_map(uint64_t virt, uint64_t phys, size_t size, uint64_t size_flag) {
+    uint64_t *pte = host_pte(virt);
+    if (!pte || !host_pte(virt + size - 1)) return false;
+
+    if (mmap((void *)virt, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             ram_fd, phys) == MAP_FAILED) {
+        perror("host-bench: alias mmap");
+        return false;
+    }
+    for (size_t off = 0; off < size; off += PAGE_SIZE) {
+        pte[off / PAGE_SIZE] = (phys + off) | PTE_PRESENT | size_flag;
+    }
+    return true;
+}
+
+void vmm_map_page(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
+    (void)pml4;
+    (void)flags;
+    host_map(virt, phys, PAGE_SIZE, 0);
+}
+
+void vmm_map_huge_page(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
+    (void)pml4;
+    (void)flags;
+    host_map(virt, phys, LARGE_PAGE_SIZE, HOST_PTE_2M);
+}
+
+bool vmm_map_huge_page_1g(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
+    (void)pml4;
+    (void)flags;
+    return host_map(virt, phys, HUGE_PAGE_1G_SIZE, HOST_PTE_1G);
+}
+
+void vmm_unmap_page(uint64_t *pml4, uint64_t virt) {
+    (void)pml4;
+    uint64_t *pte = host_pte(virt);
+    if (!pte) return;
+
+    size_t size = PAGE_SIZE;
+    if (*pte & HOST_PTE_1G) {
+        size = HUGE_PAGE_1G_SIZE;
+    } else if (*pte & HOST_PTE_2M) {
+        size = LARGE_PAGE_SIZE;
+    }
+    virt &= ~(size - 1);
+
+    munmap((void *)virt, size);
+    pte = host_pte(virt);
+    for (size_t i = 0; i < size / PAGE_SIZE; i++) {
+        pte[i] = 0;
+    }
+}
+
+bool vmm_remap_page(uint64_t *pml4, uint64_t virt, uint64_t old_phys, uint64_t new_phys) {
+    (void)pml4;
+    uint64_t *pte = host_pte(virt);
+    if (!pte || *pte != (old_phys | PTE_PRESENT)) return false;
+
+    return host_map(virt, new_phys, PAGE_SIZE, 0);
+}
+
+uint64_t vmm_get_physical_address(uint64_t *pml4, uint64_t virt) {
+    (void)pml4;
+    uint64_t *pte = host_pte(virt);
+    if (!pte || !(*pte & PTE_PRESENT)) return 0;
+
+    return (*pte & PTE_ADDR_MASK) | (virt & (PAGE_SIZE - 1));
+}
@@ -0,0 +1,22 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limine.h>
+
+// Start of the window the emulated VMM can map (user space on the host)
+#define HOST_VIRT_BASE   0x600000000000UL
+#define HOST_VIRT_PAGES  (1UL << 20)
+
+// Silence kprintf (the kernel's own tests are chatty)
+extern bool host_quiet;
+
+// Build a Limine-style memmap over size_mb of simulated RAM and an HHDM
+// backed by a memfd, so the emulated VMM can alias frames at other
+// addresses the way real page tables do
+bool host_boot(size_t size_mb, struct limine_memmap_response **memmap,
+               struct limine_hhdm_response **hhdm);
+
+#endif // HOST_H
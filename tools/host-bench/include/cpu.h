@@ -0,0 +1,51 @@
+#ifndef CPU_H
+#define CPU_H
+
+// Host stand-in for include/cpu.h: one CPU, and no interrupt flag to save
+// in user space. Everything else matches the kernel version.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAX_CPUS 16
+
+#define RFLAGS_IF (1UL << 9)
+
+static inline unsigned int cpu_id(void) {
+    return 0;
+}
+
+static inline uint64_t irq_save(void) {
+    return 0;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    (void)flags;
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile("cpuid"
+                 : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf), "c"(subleaf));
+}
+
+#define CPUID_1_ECX_POPCNT (1U << 23)
+#define CPUID_80000001_EDX_PDPE1GB (1U << 26)
+
+// The emulated page tables take any page size
+static inline bool cpu_has_1g_pages(void) {
+    return true;
+}
+
+static inline uint64_t tsc_mhz(void) {
+    return 0;
+}
+
+#endif // CPU_H
@@ -0,0 +1,431 @@
+// Host-side test and benchmark driver for the memory allocators (PMM, slab,
+// heap, huge page pools). Run through `make host-bench`.
+//
+//   host-bench [-m MB] [-n ops] [-s seed] [-v]
+//
+// Exits non-zero if a self-check fails, so it can gate changes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <limine.h>
+#include <cpu.h>
+#include <pmm.h>
+#include <slab.h>
+#include <heap.h>
+#include <numa.h>
+#include <memblock.h>
+#include <vmm.h>
+#include <hugepage.h>
+#include <mm_constants.h>
+#include "host.h"
+
+#define SLOTS 8192
+
+static uint64_t rng_state;
+static int failures = 0;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(bool ok, const char *what) {
+    printf("  %-40s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+// Per-operation latency samples in cycles
+typedef struct {
+    const char *name;
+    uint32_t *cycles;
+    size_t count;
+} latency_t;
+
+static void latency_init(latency_t *lat, const char *name, size_t cap) {
+    lat->name = name;
+    lat->cycles = malloc(cap * sizeof(uint32_t));
+    lat->count = 0;
+}
+
+static void latency_add(latency_t *lat, uint64_t cycles) {
+    lat->cycles[lat->count++] = cycles > UINT32_MAX ? UINT32_MAX : cycles;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void latency_report(latency_t *lat, double seconds) {
+    if (!lat->count) {
+        printf("  %-14s no samples\n", lat->name);
+        free(lat->cycles);
+        return;
+    }
+
+    qsort(lat->cycles, lat->count, sizeof(uint32_t), compare_u32);
+    size_t n = lat->count;
+    printf("  %-14s %8zu ops %7.2f Mops/s  cycles p50 %5u p90 %5u p99 %6u p99.9 %7u max %8u\n",
+           lat->name, n, seconds > 0 ? n / seconds / 1e6 : 0.0,
+           lat->cycles[n / 2], lat->cycles[n * 90 / 100], lat->cycles[n * 99 / 100],
+           lat->cycles[n * 999 / 1000], lat->cycles[n - 1]);
+    free(lat->cycles);
+}
+
+static void fragmentation_report(void) {
+    printf("  fragmentation index by order (-1 = block available):");
+    for (size_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        printf(" %d", pmm_fragmentation_index(order));
+    }
+    printf("\n");
+}
+
+// Random page allocations of mixed sizes over a fixed set of slots, then a
+// fragmentation report with every other slot still held
+static void workload_pmm(size_t ops) {
+    static void *ptrs[SLOTS];
+    static size_t counts[SLOTS];
+    static uint8_t kinds[SLOTS];
+    latency_t alloc_lat, free_lat;
+    size_t failed = 0;
+
+    printf("\nPMM: random alloc/free, %zu ops over %d slots\n", ops, SLOTS);
+    latency_init(&alloc_lat, "alloc", ops);
+    latency_init(&free_lat, "free", ops);
+
+    pmm_drain_local_cache();
+    size_t free_before = pmm_get_free_memory();
+    double start = now_seconds();
+    host_quiet = true;
+
+    for (size_t op = 0; op < ops; op++) {
+        size_t i = rng() % SLOTS;
+
+        if (ptrs[i]) {
+            uint64_t t = rdtsc();
+            if (kinds[i] == 0) pmm_free_page(ptrs[i]);
+            else if (kinds[i] == 1) pmm_free_pages_exact(ptrs[i], counts[i]);
+            else pmm_free_pages(ptrs[i], counts[i]);
+            latency_add(&free_lat, rdtsc() - t);
+            ptrs[i] = NULL;
+            continue;
+        }
+
+        // 70% single frames, 28% small runs, 2% large blocks
+        unsigned roll = rng() % 100;
+        kinds[i] = roll < 70 ? 0 : roll < 98 ? 1 : 2;
+        counts[i] = kinds[i] == 0 ? 1 : kinds[i] == 1 ? 2 + rng() % 63 : 65 + rng() % 960;
+
+        uint64_t t = rdtsc();
+        if (kinds[i] == 0) ptrs[i] = pmm_alloc_page();
+        else if (kinds[i] == 1) ptrs[i] = pmm_alloc_pages_exact(counts[i]);
+        else ptrs[i] = pmm_alloc_pages(counts[i]);
+        latency_add(&alloc_lat, rdtsc() - t);
+        if (!ptrs[i]) failed++;
+    }
+
+    host_quiet = false;
+    double seconds = now_seconds() - start;
+    latency_report(&alloc_lat, seconds);
+    latency_report(&free_lat, seconds);
+    printf("  failed allocations: %zu\n", failed);
+
+    for (size_t i = 0; i < SLOTS; i += 2) {
+        if (!ptrs[i]) continue;
+        if (kinds[i] == 0) pmm_free_page(ptrs[i]);
+        else if (kinds[i] == 1) pmm_free_pages_exact(ptrs[i], counts[i]);
+        else pmm_free_pages(ptrs[i], counts[i]);
+        ptrs[i] = NULL;
+    }
+    pmm_drain_local_cache();
+    printf("  with every other slot still held:\n");
+    pmm_print_stats();
+
+    for (size_t i = 0; i < SLOTS; i++) {
+        if (!ptrs[i]) continue;
+        if (kinds[i] == 0) pmm_free_page(ptrs[i]);
+        else if (kinds[i] == 1) pmm_free_pages_exact(ptrs[i], counts[i]);
+        else pmm_free_pages(ptrs[i], counts[i]);
+        ptrs[i] = NULL;
+    }
+    pmm_drain_local_cache();
+
+    check(pmm_get_free_memory() == free_before, "every page returned");
+    check(pmm_check_counters(), "PMM counters consistent");
+}
+
+// kmalloc/kfree of mixed sizes. Each object carries its slot number at
+// both ends, checked before it is freed, to catch overlapping allocations.
+static void workload_heap(size_t ops) {
+    static uint8_t *ptrs[SLOTS];
+    static size_t sizes[SLOTS];
+    latency_t alloc_lat, free_lat;
+    size_t failed = 0, corrupted = 0;
+
+    printf("\nHeap: random kmalloc/kfree, %zu ops over %d slots\n", ops, SLOTS);
+    latency_init(&alloc_lat, "kmalloc", ops);
+    latency_init(&free_lat, "kfree", ops);
+    double start = now_seconds();
+    host_quiet = true;
+
+    for (size_t op = 0; op < ops; op++) {
+        size_t i = rng() % SLOTS;
+
+        if (ptrs[i]) {
+            if (ptrs[i][0] != (uint8_t)i || ptrs[i][sizes[i] - 1] != (uint8_t)i) corrupted++;
+            uint64_t t = rdtsc();
+            kfree(ptrs[i]);
+            latency_add(&free_lat, rdtsc() - t);
+            ptrs[i] = NULL;
+            continue;
+        }
+
+        // 80% small (slab classes), 15% up to a page, 5% multi-page
+        unsigned roll = rng() % 100;
+        sizes[i] = roll < 80 ? 1 + rng() % SLAB_MAX_SIZE
+                 : roll < 95 ? SLAB_MAX_SIZE + 1 + rng() % (PAGE_SIZE - SLAB_MAX_SIZE)
+                 : PAGE_SIZE + 1 + rng() % (15 * PAGE_SIZE);
+
+        uint64_t t = rdtsc();
+        ptrs[i] = kmalloc(sizes[i]);
+        latency_add(&alloc_lat, rdtsc() - t);
+        if (!ptrs[i]) {
+            failed++;
+            continue;
+        }
+        ptrs[i][0] = ptrs[i][sizes[i] - 1] = (uint8_t)i;
+    }
+
+    host_quiet = false;
+    double seconds = now_seconds() - start;
+    latency_report(&alloc_lat, seconds);
+    latency_report(&free_lat, seconds);
+
+    for (size_t i = 0; i < SLOTS; i++) {
+        if (!ptrs[i]) continue;
+        if (ptrs[i][0] != (uint8_t)i || ptrs[i][sizes[i] - 1] != (uint8_t)i) corrupted++;
+        kfree(ptrs[i]);
+        ptrs[i] = NULL;
+    }
+
+    printf("  failed allocations: %zu\n", failed);
+    check(corrupted == 0, "no overlapping heap objects");
+}
+
+static void workload_slab(size_t ops) {
+    static void *ptrs[SLOTS];
+    latency_t alloc_lat, free_lat;
+
+    printf("\nSlab: cache of 96-byte objects, %zu ops over %d slots\n", ops, SLOTS);
+    CACHE *cache = cache_create(96, 8, 0);
+    if (!cache) {
+        check(false, "cache_create");
+        return;
+    }
+
+    latency_init(&alloc_lat, "cache_alloc", ops);
+    latency_init(&free_lat, "cache_free", ops);
+    double start = now_seconds();
+
+    for (size_t op = 0; op < ops; op++) {
+        size_t i = rng() % SLOTS;
+        uint64_t t = rdtsc();
+
+        if (ptrs[i]) {
+            cache_free(cache, ptrs[i]);
+            latency_add(&free_lat, rdtsc() - t);
+            ptrs[i] = NULL;
+        } else {
+            ptrs[i] = cache_alloc(cache);
+            latency_add(&alloc_lat, rdtsc() - t);
+        }
+    }
+
+    double seconds = now_seconds() - start;
+    latency_report(&alloc_lat, seconds);
+    latency_report(&free_lat, seconds);
+
+    for (size_t i = 0; i < SLOTS; i++) {
+        if (ptrs[i]) cache_free(cache, ptrs[i]);
+        ptrs[i] = NULL;
+    }
+    cache_destroy(cache);
+}
+
+// Compaction under pressure: take every free page, give one max-order block
+// back as movable pages mapped through the emulated VMM, free three in four
+// of them, then ask for an order-9 block. Only migration can produce it, and
+// the survivors must keep their data wherever they end up.
+static void workload_compaction(void) {
+    size_t max_blocks = pmm_get_total_memory() / PAGES_TO_BYTES(PMM_MAX_CONTIGUOUS_PAGES) + 1;
+    size_t max_pages = pmm_get_total_memory() / PAGE_SIZE;
+    void **blocks = malloc(max_blocks * sizeof(void *));
+    void **pages = malloc(max_pages * sizeof(void *));
+    uintptr_t *movable = malloc(PMM_MAX_CONTIGUOUS_PAGES * sizeof(uintptr_t));
+    size_t block_count = 0, page_count = 0, mapped = 0, moved = 0, bad = 0;
+
+    printf("\nCompaction: all memory taken, %lu movable pages, 3 in 4 freed\n",
+           PMM_MAX_CONTIGUOUS_PAGES);
+    pmm_drain_local_cache();
+    size_t free_before = pmm_get_free_memory();
+
+    host_quiet = true;
+    while (block_count < max_blocks &&
+           (blocks[block_count] = pmm_alloc_pages(PMM_MAX_CONTIGUOUS_PAGES))) {
+        block_count++;
+    }
+    while (page_count < max_pages && (pages[page_count] = pmm_alloc_page())) {
+        page_count++;
+    }
+    host_quiet = false;
+
+    if (block_count) {
+        pmm_free_pages(blocks[--block_count], PMM_MAX_CONTIGUOUS_PAGES);
+    }
+    for (; mapped < PMM_MAX_CONTIGUOUS_PAGES; mapped++) {
+        uint64_t virt = HOST_VIRT_BASE + PAGES_TO_BYTES(mapped);
+        movable[mapped] = (uintptr_t)pmm_alloc_page_movable(kernel_pml4, virt);
+        if (!movable[mapped]) break;
+        vmm_map_page(kernel_pml4, virt, movable[mapped], PTE_KERNEL_DATA);
+        *(volatile uint64_t *)virt = virt;
+    }
+    for (size_t i = 0; i < mapped; i++) {
+        if (i % 4 == 0) continue;
+        vmm_unmap_page(kernel_pml4, HOST_VIRT_BASE + PAGES_TO_BYTES(i));
+        pmm_free_page((void *)movable[i]);
+    }
+    pmm_drain_local_cache();
+
+    printf("  %lu MB free in scattered pages\n", pmm_get_free_memory() / (1024 * 1024));
+    fragmentation_report();
+    uint64_t t = rdtsc();
+    bool compacted = pmm_compact(9);
+    t = rdtsc() - t;
+    printf("  pmm_compact(9): %s, %lu cycles\n", compacted ? "order-9 block freed" : "failed", t);
+    fragmentation_report();
+
+    for (size_t i = 0; i < mapped; i += 4) {
+        uint64_t virt = HOST_VIRT_BASE + PAGES_TO_BYTES(i);
+        uintptr_t now = vmm_get_physical_address(kernel_pml4, virt);
+        if (now != movable[i]) moved++;
+        if (*(volatile uint64_t *)virt != virt) bad++;
+        vmm_unmap_page(kernel_pml4, virt);
+        pmm_free_page((void *)now);
+    }
+    printf("  %zu of %zu pages migrated\n", moved, (mapped + 3) / 4);
+
+    while (page_count) {
+        pmm_free_page(pages[--page_count]);
+    }
+    while (block_count) {
+        pmm_free_pages(blocks[--block_count], PMM_MAX_CONTIGUOUS_PAGES);
+    }
+    pmm_drain_local_cache();
+    free(blocks);
+    free(pages);
+    free(movable);
+
+    check(compacted && moved > 0, "compaction migrated pages");
+    check(bad == 0, "migrated data intact");
+    // Running out of memory lets the shrinkers release empty slabs too
+    check(pmm_get_free_memory() >= free_before, "no pages leaked");
+    check(pmm_check_counters(), "PMM counters consistent");
+}
+
+static void workload_hugepage(void) {
+    printf("\nHuge pages: 2MB pool round trip\n");
+
+    size_t added = hugepage_reserve(HUGEPAGE_2M, 16);
+    void *frame = hugepage_alloc(HUGEPAGE_2M);
+    bool ok = frame && hugepage_map(kernel_pml4, HOST_VIRT_BASE, frame, HUGEPAGE_2M,
+                                    PTE_KERNEL_DATA);
+    if (ok) {
+        volatile uint64_t *tail = (uint64_t *)(HOST_VIRT_BASE + LARGE_PAGE_SIZE - 8);
+        *tail = 0x2222;
+        ok = *(uint64_t *)pmm_phys_to_virt((uint8_t *)frame + LARGE_PAGE_SIZE - 8) == 0x2222;
+        hugepage_unmap(kernel_pml4, HOST_VIRT_BASE, HUGEPAGE_2M);
+    }
+    if (frame) hugepage_free(frame, HUGEPAGE_2M);
+
+    hugepage_print_stats();
+    check(ok && added == 16, "2MB frame mapped and written");
+    check(hugepage_shrink(HUGEPAGE_2M, 16) == 16, "pool shrinks back");
+}
+
+int main(int argc, char **argv) {
+    size_t size_mb = 1024;
+    size_t ops = 200000;
+    bool verbose = false;
+    int opt;
+
+    rng_state = 0x9E3779B97F4A7C15UL;
+    while ((opt = getopt(argc, argv, "m:n:s:v")) != -1) {
+        switch (opt) {
+        case 'm': size_mb = strtoul(optarg, NULL, 0); break;
+        case 'n': ops = strtoul(optarg, NULL, 0); break;
+        case 's': rng_state = strtoul(optarg, NULL, 0) | 1; break;
+        case 'v': verbose = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-m MB] [-n ops] [-s seed] [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    struct limine_memmap_response *memmap;
+    struct limine_hhdm_response *hhdm;
+    if (!host_boot(size_mb, &memmap, &hhdm)) {
+        return 2;
+    }
+
+    printf("Boot: %zu MB simulated RAM\n", size_mb);
+    host_quiet = !verbose;
+    memblock_init(memmap);
+    numa_init();
+    host_quiet = false;
+
+    uint64_t t = rdtsc();
+    pmm_init(memmap, hhdm);
+    printf("pmm_init: %lu cycles\n", rdtsc() - t);
+
+    host_quiet = !verbose;
+    hugepage_init(hhdm);
+    slab_init();
+    heap_init(hhdm);
+    t = rdtsc();
+    while (pmm_idle_work());
+    host_quiet = false;
+    printf("Idle work (deferred sections, zero pool): %lu cycles\n", rdtsc() - t);
+
+    // The kernel's own self-tests, quiet unless -v
+    printf("\nKernel self-tests\n");
+    host_quiet = !verbose;
+    test_pmm();
+    test_heap();
+    pmm_reclaim_boot_memory();
+    host_quiet = false;
+    check(pmm_check_counters(), "test_pmm / test_heap left counters consistent");
+
+    workload_pmm(ops);
+    workload_heap(ops);
+    workload_slab(ops);
+    workload_compaction();
+    workload_hugepage();
+
+    bench_pmm();
+
+    printf("\n%s\n", failures ? "host-bench: FAILED" : "host-bench: all checks passed");
+    return failures ? 1 : 0;
+}